@@ -0,0 +1,249 @@
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include "archive.hpp"
+
+using namespace std;
+
+namespace {
+const size_t BLOCK = 512;
+const char PACK[8] = {'I', 'C', 'F', 'P', 'A', 'C', 'K', '1'};
+
+// a pack is PACK, u32 count, then per member u32 name length, name, u64
+// offset and u64 size, then the data of members; integers little endian
+void put(string &out, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out += char(v >> (8 * i));
+  }
+}
+uint64_t get(const char *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; ++i) {
+    v |= uint64_t(uint8_t(p[i])) << (8 * i);
+  }
+  return v;
+}
+
+// numeric tar field: octal, or base-256 when the top bit is set (GNU, > 8GB)
+uint64_t number(const char *p, size_t len) {
+  uint64_t v = 0;
+  if (uint8_t(p[0]) & 0x80) {
+    v = uint8_t(p[0]) & 0x7f;
+    for (size_t i = 1; i < len; ++i) {
+      v = v << 8 | uint8_t(p[i]);
+    }
+    return v;
+  }
+  for (size_t i = 0; i < len and p[i]; ++i) {
+    if (p[i] >= '0' and p[i] <= '7') {
+      v = v * 8 + (p[i] - '0');
+    }
+  }
+  return v;
+}
+
+string field(const char *p, size_t len) { return string(p, strnlen(p, len)); }
+
+bool isTar(const char *h) { // checksum counts its own field as spaces
+  uint64_t sum = 0;
+  for (size_t i = 0; i < BLOCK; ++i) {
+    sum += i >= 148 and i < 156 ? ' ' : uint8_t(h[i]);
+  }
+  return sum == number(h + 148, 8);
+}
+
+bool sniff(const string &fname) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char h[BLOCK];
+  ssize_t n = read(fd, h, BLOCK);
+  close(fd);
+  return (n >= ssize_t(sizeof(PACK)) and memcmp(h, PACK, sizeof(PACK)) == 0) or
+         (n == ssize_t(BLOCK) and isTar(h));
+}
+}
+
+namespace icfarc {
+Archive::Archive(const string &fname) : map_(fname) {
+  char pathbuf[MAXPATHLEN];
+  struct stat st;
+  if (not map_.ok() or not realpath(fname.c_str(), pathbuf) or
+      stat(pathbuf, &st) != 0) {
+    cerr << "-- cannot read archive: " << fname << endl;
+    exit(-1);
+  }
+  path_ = pathbuf;
+  mtime_ = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  if (map_.size() >= sizeof(PACK) and
+      memcmp(map_.data(), PACK, sizeof(PACK)) == 0) {
+    pack();
+  } else {
+    tar();
+  }
+}
+
+void Archive::tar() {
+  const char *data = map_.data();
+  size_t size = map_.size(), off = 0;
+  string longName; // of the next member, from a GNU 'L' or pax 'x' entry
+  while (off + BLOCK <= size) {
+    const char *h = data + off;
+    if (h[0] == '\0') {
+      break; // end of archive is two zero blocks
+    }
+    if (not isTar(h)) {
+      cerr << "-- bad tar header at " << off << " in " << path_ << endl;
+      exit(-1);
+    }
+    size_t len = number(h + 124, 12), at = off + BLOCK;
+    if (at + len > size) {
+      cerr << "-- truncated tar member at " << off << " in " << path_ << endl;
+      exit(-1);
+    }
+    string name = field(h, 100);
+    if (memcmp(h + 257, "ustar", 5) == 0 and h[345]) {
+      name = field(h + 345, 155) + '/' + name;
+    }
+    char type = h[156];
+    if (type == 'L') {
+      longName = field(data + at, len);
+    } else if (type == 'x') { // records of "len key=value\n"
+      for (size_t p = 0; p < len;) {
+        size_t rlen = strtoul(data + at + p, NULL, 10);
+        string rec(data + at + p, min(rlen, len - p));
+        size_t sp = rec.find(' '), eq = rec.find('=');
+        if (sp != string::npos and eq == sp + 5 and
+            rec.compare(sp + 1, 5, "path=") == 0) {
+          longName = rec.substr(eq + 1, rec.size() - eq - 2); // no '\n'
+        }
+        p += rlen ? rlen : len;
+      }
+    } else {
+      if (type == '0' or type == '\0' or type == '7') {
+        members_[normalize(longName.empty() ? name : longName)] =
+            make_pair(at, len);
+      }
+      longName.clear();
+    }
+    off = at + (len + BLOCK - 1) / BLOCK * BLOCK;
+  }
+}
+
+void Archive::pack() {
+  const char *data = map_.data();
+  size_t size = map_.size(), p = sizeof(PACK);
+  auto bad = [&]() {
+    cerr << "-- truncated or bad pack: " << path_ << endl;
+    exit(-1);
+  };
+  if (p + 4 > size) {
+    bad();
+  }
+  uint32_t count = get(data + p, 4);
+  p += 4;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (p + 4 > size) {
+      bad();
+    }
+    size_t nlen = get(data + p, 4);
+    p += 4;
+    if (p + nlen + 16 > size) {
+      bad();
+    }
+    string name(data + p, nlen);
+    p += nlen;
+    uint64_t off = get(data + p, 8), len = get(data + p + 8, 8);
+    p += 16;
+    if (off > size or len > size - off) {
+      bad();
+    }
+    members_[name] = make_pair(off, len);
+  }
+}
+
+bool Archive::find(const string &member, const char *&data,
+                   size_t &size) const {
+  auto itr = members_.find(normalize(member));
+  if (itr == members_.end()) {
+    return false;
+  }
+  data = map_.data() + itr->second.first;
+  size = itr->second.second;
+  return true;
+}
+
+string Archive::normalize(const string &member) {
+  vector<string> parts;
+  size_t b = 0;
+  while (b <= member.size()) {
+    size_t e = member.find('/', b);
+    if (e == string::npos) {
+      e = member.size();
+    }
+    string part = member.substr(b, e - b);
+    if (part == "..") {
+      if (not parts.empty()) {
+        parts.pop_back();
+      }
+    } else if (not part.empty() and part != ".") {
+      parts.push_back(part);
+    }
+    b = e + 1;
+  }
+  return sophoi::join("/", begin(parts), end(parts));
+}
+
+bool Archive::split(const string &fname, string &archive, string &member) {
+  for (size_t c = fname.find(':'); c != string::npos;
+       c = fname.find(':', c + 1)) {
+    struct stat st;
+    string a = fname.substr(0, c);
+    if (stat(a.c_str(), &st) == 0 and S_ISREG(st.st_mode) and sniff(a)) {
+      archive = a;
+      member = fname.substr(c + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+int pack(const vector<string> &files) {
+  string index(PACK, sizeof(PACK));
+  put(index, files.size(), 4);
+  size_t at = index.size();
+  vector<size_t> sizes;
+  for (auto &f : files) {
+    struct stat st;
+    if (stat(f.c_str(), &st) != 0 or not S_ISREG(st.st_mode)) {
+      cerr << "-- cannot read file: " << f << endl;
+      return -1;
+    }
+    sizes.push_back(st.st_size);
+    at += 4 + Archive::normalize(f).size() + 16;
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    auto name = Archive::normalize(files[i]);
+    put(index, name.size(), 4);
+    index += name;
+    put(index, at, 8);
+    put(index, sizes[i], 8);
+    at += sizes[i];
+  }
+  cout.write(index.data(), index.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    sophoi::MappedFile mf(files[i]);
+    if (not mf.ok() or mf.size() != sizes[i]) {
+      cerr << "-- cannot read file, or it changed: " << files[i] << endl;
+      return -1;
+    }
+    cout.write(mf.data(), mf.size());
+  }
+  return cout ? 0 : -1;
+}
+}
@@ -0,0 +1,45 @@
+#ifndef __ICF_ARCHIVE_HPP__
+#define __ICF_ARCHIVE_HPP__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "util.hpp"
+
+// a release of .icf files kept as one archive: an uncompressed tar, or a pack
+// written by icfdiff --pack. "archive:member" names a file in it, and its
+// includes are looked up among the other members before the disk; members are
+// parsed in place from the one map of the archive
+namespace icfarc {
+class Archive {
+public:
+  explicit Archive(const std::string &fname); // exits if not an archive
+  Archive(const Archive &) = delete;
+  Archive &operator=(const Archive &) = delete;
+
+  const std::string &path() const { return path_; } // real path
+  long long mtime() const { return mtime_; }        // in ns, as Icf::Sources
+  // false if no member is by that name, once normalized
+  bool find(const std::string &member, const char *&data, size_t &size) const;
+
+  // a/./b//../c to a/c, as members are indexed
+  static std::string normalize(const std::string &member);
+  // whether fname is "archive:member" with archive a tar or pack file
+  static bool split(const std::string &fname, std::string &archive,
+                    std::string &member);
+
+private:
+  void tar();
+  void pack();
+
+  sophoi::MappedFile map_;
+  std::string path_;
+  long long mtime_ = 0;
+  std::unordered_map<std::string, std::pair<size_t, size_t>> members_;
+};
+
+// icfdiff --pack: the files, by their names normalized, as a pack to stdout
+int pack(const std::vector<std::string> &files);
+}
+
+#endif
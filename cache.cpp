@@ -0,0 +1,61 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "util.hpp"
+#include "cache.hpp"
+
+using namespace std;
+
+namespace {
+// what output depends on besides the trees: parsing env is in the digests
+const char *RENDERING[] = {"KVSEPS", "DISPLAY_PREFIX", "OUTPUT_FORMAT",
+                           "SHOW_MOVED"};
+
+void render(const Icf &old, const Icf &neu, ostream &out) {
+  out << old.diff(neu);
+  out << neu.diff(old, true);
+}
+}
+
+namespace icfcache {
+void diff(const Icf &old, const Icf &neu, ostream &out) {
+  const char *dir = getenv("DIFF_CACHE");
+  const char *so = getenv("SHOW_ORIGIN");
+  if (not dir or not *dir or (so and *so and string(so) != "0")) {
+    render(old, neu, out);
+    return;
+  }
+  string env;
+  for (auto e : RENDERING) {
+    const char *v = getenv(e);
+    env += string(e) + '=' + (v ? v : "") + '\x1f';
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "%016llx-%016llx-%016llx", old.digest(),
+           neu.digest(), sophoi::fnv1a(env));
+  string path = string(dir) + '/' + name;
+  {
+    sophoi::MappedFile hit(path);
+    if (hit.ok()) {
+      out.write(hit.data(), hit.size());
+      return;
+    }
+  }
+  ostringstream o;
+  render(old, neu, o);
+  auto text = o.str();
+  // written aside then renamed, so a reader sees all of it or none
+  string tmp = path + ".tmp" + to_string(getpid());
+  ofstream f(tmp, ios::binary);
+  f.write(text.data(), text.size());
+  f.close();
+  if (not f or rename(tmp.c_str(), path.c_str()) != 0) {
+    cerr << "-- cannot write diff cache: " << path << endl;
+    unlink(tmp.c_str());
+  }
+  out << text;
+}
+}
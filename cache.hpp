@@ -0,0 +1,16 @@
+#ifndef __ICF_CACHE_HPP__
+#define __ICF_CACHE_HPP__
+
+#include <iosfwd>
+#include "icf.hpp"
+
+// rendered diffs kept on disk (DIFF_CACHE) by the content digests of both
+// trees, so the same pair diffed again is a file read instead of a diff
+namespace icfcache {
+// what old.diff(neu) then neu.diff(old, true) print, from the cache if there
+// and added to it if not; origins are not in digests, so SHOW_ORIGIN=1 runs
+// the diff as usual
+void diff(const Icf &old, const Icf &neu, std::ostream &out);
+}
+
+#endif
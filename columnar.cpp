@@ -0,0 +1,149 @@
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <string.h>
+#include "icf.hpp"
+#include "delta.hpp"
+#include "columnar.hpp"
+
+using namespace std;
+
+namespace {
+// strings of one column, ids given in sorted order once all are added
+class Encoder {
+  unordered_map<string, uint32_t> ids_;
+  vector<const string *> sorted_;
+
+public:
+  void add(const string &s) { ids_.emplace(s, 0); }
+  void seal() {
+    for (auto &si : ids_) {
+      sorted_.push_back(&si.first);
+    }
+    sort(begin(sorted_), end(sorted_),
+         [](const string *a, const string *b) { return *a < *b; });
+    if (sorted_.size() > UINT32_MAX) {
+      cerr << "-- over 4G distinct strings in a column" << endl;
+      exit(-1);
+    }
+    for (size_t i = 0; i < sorted_.size(); ++i) {
+      ids_[*sorted_[i]] = i;
+    }
+  }
+  uint32_t id(const string &s) const { return ids_.find(s)->second; }
+  const vector<const string *> &sorted() const { return sorted_; }
+};
+
+size_t align(size_t n) { return (n + 7) & ~size_t(7); }
+
+// offsets then bytes, returning where it starts
+icfcol::Dict dict(string &out, const Encoder &enc) {
+  icfcol::Dict d;
+  d.count = enc.sorted().size();
+  d.offsets = out.size();
+  uint64_t at = 0;
+  for (auto s : enc.sorted()) {
+    out.append(reinterpret_cast<const char *>(&at), sizeof(at));
+    at += s->size();
+  }
+  out.append(reinterpret_cast<const char *>(&at), sizeof(at));
+  d.bytes = out.size();
+  for (auto s : enc.sorted()) {
+    out += *s;
+  }
+  out.resize(align(out.size()), '\0');
+  return d;
+}
+
+uint64_t column(string &out, const vector<uint32_t> &ids) {
+  uint64_t at = out.size();
+  out.append(reinterpret_cast<const char *>(ids.data()),
+             ids.size() * sizeof(uint32_t));
+  out.resize(align(out.size()), '\0');
+  return at;
+}
+}
+
+void Icf::columnar_to(std::ostream &output) const {
+  Encoder sections, keys, symbols, values, groups;
+  size_t rows = 0, members = 0;
+  for (auto &ks : store_) {
+    sections.add(ks.first.first);
+    keys.add(ks.first.second);
+    for (auto &sv : ks.second) {
+      symbols.add(sv.first);
+      values.add(sv.second.first);
+    }
+    rows += ks.second.size();
+  }
+  for (auto &kv : groups_) {
+    groups.add(kv.first);
+    for (auto &m : kv.second) {
+      symbols.add(m);
+    }
+    members += kv.second.size();
+  }
+  for (auto e : {&sections, &keys, &symbols, &values, &groups}) {
+    e->seal();
+  }
+
+  struct Row {
+    uint32_t section, key, symbol, value;
+  };
+  std::vector<Row> byKey;
+  byKey.reserve(rows);
+  for (auto &ks : store_) {
+    uint32_t s = sections.id(ks.first.first), k = keys.id(ks.first.second);
+    for (auto &sv : ks.second) { // by symbol already
+      byKey.push_back(
+          Row{s, k, symbols.id(sv.first), values.id(sv.second.first)});
+    }
+  }
+  std::sort(begin(byKey), end(byKey), [](const Row &a, const Row &b) {
+    return a.section != b.section ? a.section < b.section
+           : a.key != b.key       ? a.key < b.key
+                                  : a.symbol < b.symbol;
+  });
+
+  icfcol::Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, icfcol::MAGIC, sizeof(h.magic));
+  std::string out(align(sizeof(h)), '\0');
+  h.sections = dict(out, sections);
+  h.keys = dict(out, keys);
+  h.symbols = dict(out, symbols);
+  h.values = dict(out, values);
+  h.groups = dict(out, groups);
+  h.rows = rows;
+  std::vector<uint32_t> ids(rows);
+  uint32_t Row::*cols[] = {&Row::section, &Row::key, &Row::symbol,
+                           &Row::value};
+  uint64_t *at[] = {&h.section, &h.key, &h.symbol, &h.value};
+  for (size_t c = 0; c < 4; ++c) {
+    for (size_t r = 0; r < rows; ++r) {
+      ids[r] = byKey[r].*cols[c];
+    }
+    *at[c] = column(out, ids);
+  }
+  h.members = members;
+  std::vector<uint32_t> mg, ms;
+  for (auto &kv : groups_) { // groups and members both sorted
+    for (auto &m : kv.second) {
+      mg.push_back(groups.id(kv.first));
+      ms.push_back(symbols.id(m));
+    }
+  }
+  h.memberGroup = column(out, mg);
+  h.memberSymbol = column(out, ms);
+  h.size = out.size();
+  memcpy(&out[0], &h, sizeof(h));
+  output.write(out.data(), out.size());
+}
+
+namespace icfcol {
+int write(const std::string &fname) {
+  icfdelta::load(fname).columnar_to(cout);
+  return cout ? 0 : -1;
+}
+}
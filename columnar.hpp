@@ -0,0 +1,33 @@
+#ifndef __ICF_COLUMNAR_HPP__
+#define __ICF_COLUMNAR_HPP__
+
+#include <string>
+#include <stdint.h>
+
+// the expanded (sections, key, symbol) -> value store of a tree, and its group
+// members, as dictionary encoded columns for analytics to map and scan. all
+// offsets are from the start of the file, in host byte order, 8 byte aligned
+namespace icfcol {
+const char MAGIC[8] = {'I', 'C', 'F', 'C', 'O', 'L', '1', '\0'};
+
+// strings sorted, so ids compare as the strings do; string i is
+// bytes[offsets[i], offsets[i + 1]), offsets being count + 1 uint64_t
+struct Dict {
+  uint64_t count, offsets, bytes;
+};
+
+struct Header {
+  char magic[8];
+  uint64_t size;
+  Dict sections, keys, symbols, values, groups; // members are in symbols
+  // uint32_t ids, one per row, rows sorted by (sections, key, symbol)
+  uint64_t rows, section, key, symbol, value;
+  // uint32_t ids, one per (group, member), sorted by group then member
+  uint64_t members, memberGroup, memberSymbol;
+};
+
+// icfdiff --columnar: of an .icf file or snapshot, to stdout
+int write(const std::string &fname);
+}
+
+#endif
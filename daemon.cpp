@@ -0,0 +1,369 @@
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "icf.hpp"
+#include "daemon.hpp"
+#include "cache.hpp"
+#include "variants.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+namespace {
+// env that changes how a tree is loaded or displayed, forwarded by client
+const char *FORWARDED[] = {"CFGPATH",         "EXCLUDE",       "DEFAULT",
+                           "KVSEPS",          "DISPLAY_PREFIX", "OUTPUT_FORMAT",
+                           "IGNORED_ITEMS",   "SELECT_SECTIONS", "SELECT_KEYS",
+                           "SELECT_SYMBOLS",  "SHOW_ORIGIN",    "SHOW_MOVED",
+                           "DIFF_CACHE",      "VALUE_HISTORY"};
+
+bool writeAll(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 and errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+bool readAll(int fd, char *p, size_t n) {
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 and errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+// frame: 4-byte big endian payload length, payload is '\0' terminated fields
+bool sendFrame(int fd, const vector<string> &fields) {
+  string payload;
+  for (auto &f : fields) {
+    payload += f;
+    payload += '\0';
+  }
+  uint32_t len = htonl(payload.size());
+  return writeAll(fd, reinterpret_cast<char *>(&len), sizeof(len)) and
+         writeAll(fd, payload.data(), payload.size());
+}
+
+bool recvFrame(int fd, vector<string> &fields) {
+  uint32_t len;
+  if (not readAll(fd, reinterpret_cast<char *>(&len), sizeof(len))) {
+    return false;
+  }
+  len = ntohl(len);
+  if (len > (1u << 30)) {
+    return false;
+  }
+  string payload(len, '\0');
+  if (len > 0 and not readAll(fd, &payload[0], len)) {
+    return false;
+  }
+  fields.clear();
+  size_t p = 0;
+  while (p < payload.size()) {
+    size_t e = payload.find('\0', p);
+    if (e == string::npos) {
+      e = payload.size();
+    }
+    fields.push_back(payload.substr(p, e - p));
+    p = e + 1;
+  }
+  return true;
+}
+
+struct Resident {
+  shared_ptr<Icf> icf;
+  // x.icf.nyc.. queried while this is x.icf, as overlays of it
+  shared_ptr<icfvar::Variants> variants;
+  string rendered; // validate output, rendered once per load
+};
+// (cwd, env, file) -> tree
+map<string, Resident> residents;
+
+bool fresh(const Icf::Sources &srcs) {
+  for (auto &s : srcs) {
+    struct stat st;
+    if (stat(s.first.c_str(), &st) != 0 or
+        st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec != s.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Resident &load(const string &ctx, const string &fname) {
+  auto &r = residents[ctx + '\0' + fname];
+  if (not r.icf.get() or not fresh(r.icf->sources())) {
+    r.icf.reset(new Icf(fname.c_str()));
+    r.rendered.clear();
+    r.variants.reset();
+  }
+  return r;
+}
+
+// x.icf.nyc is a variant of x.icf if that is a file
+bool variantOf(const string &fname, string &base) {
+  auto dot = fname.rfind('.');
+  struct stat st;
+  if (dot == string::npos or dot < 4 or
+      fname.compare(dot - 4, 4, ".icf") != 0) {
+    return false;
+  }
+  base = fname.substr(0, dot);
+  return stat(base.c_str(), &st) == 0 and S_ISREG(st.st_mode);
+}
+
+// a variant is loaded once to keep how it differs from its resident base
+const icfvar::Variants &variants(const string &ctx, const string &base,
+                                 const string &fname) {
+  auto &r = load(ctx, base);
+  if (not r.variants.get()) {
+    r.variants.reset(new icfvar::Variants(r.icf));
+  }
+  if (not r.variants->has(fname) or not fresh(r.variants->sources(fname))) {
+    r.variants->add(fname, Icf(fname.c_str()));
+  }
+  return *r.variants;
+}
+
+int run(const string &ctx, const vector<string> &args, ostream &out) {
+  auto &verb = args[0];
+  if (verb == "validate" and args.size() == 2) {
+    auto &r = load(ctx, args[1]);
+    if (r.rendered.empty()) {
+      Icf icf(*r.icf); // naming state of output must not stick to resident
+      ostringstream o;
+      o << icf << endl;
+      r.rendered = o.str();
+    }
+    out << r.rendered;
+  } else if (verb == "diff" and args.size() == 3) {
+    auto &old = *load(ctx, args[1]).icf;
+    auto &neu = *load(ctx, args[2]).icf;
+    icfcache::diff(old, neu, out);
+  } else if (verb == "query" and (args.size() == 4 or args.size() == 5)) {
+    // overlays keep only the last value; history needs the variant in full
+    const char *h = getenv("VALUE_HISTORY");
+    bool history = h and *h and string(h) != "0";
+    string base;
+    if (not history and variantOf(args[1], base)) {
+      variants(ctx, base, args[1])
+          .query_to(out, args[1], make_pair(args[2], args[3]),
+                    args.size() == 5 ? args[4] : "");
+      return 0;
+    }
+    auto &icf = *load(ctx, args[1]).icf;
+    icf.query_to(out, make_pair(args[2], args[3]),
+                 args.size() == 5 ? args[4] : "");
+  } else {
+    cerr << "-- bad request: " << verb << " with " << args.size() - 1
+         << " args" << endl;
+    return -1;
+  }
+  return 0;
+}
+
+// bad icf files exit(-1) while being loaded; tell client before worker goes
+int clientFd = -1;
+ostringstream *clientErr = NULL;
+void replyOnExit() {
+  if (clientFd >= 0) {
+    sendFrame(clientFd, {"255", "", clientErr ? clientErr->str() : ""});
+    close(clientFd);
+  }
+}
+
+// request: verb, cwd, #env, env (K=V)..., args...
+void handle(int fd) {
+  vector<string> req;
+  if (not recvFrame(fd, req) or req.size() < 3) {
+    close(fd);
+    return;
+  }
+  size_t nenv = strtoul(req[2].c_str(), NULL, 10);
+  if (req.size() < 3 + nenv) {
+    close(fd);
+    return;
+  }
+  ostringstream out, err;
+  auto obuf = cout.rdbuf(out.rdbuf());
+  auto ebuf = cerr.rdbuf(err.rdbuf());
+  clientFd = fd;
+  clientErr = &err;
+
+  int code = -1;
+  string ctx = req[1];
+  for (auto &e : FORWARDED) {
+    unsetenv(e);
+  }
+  for (size_t i = 3; i < 3 + nenv; ++i) {
+    auto eq = req[i].find('=');
+    if (eq != string::npos) {
+      setenv(req[i].substr(0, eq).c_str(), req[i].substr(eq + 1).c_str(), 1);
+    }
+    ctx += '\0' + req[i];
+  }
+  vector<string> args = {req[0]};
+  args.insert(end(args), begin(req) + 3 + nenv, end(req));
+  if (chdir(req[1].c_str()) != 0) {
+    cerr << "-- cannot change to client dir: " << req[1] << endl;
+  } else {
+    ICF_TRACE1(request, args[0].c_str());
+    code = run(ctx, args, out);
+    ICF_TRACE2(request_done, args[0].c_str(), code);
+  }
+
+  cout.rdbuf(obuf);
+  cerr.rdbuf(ebuf);
+  clientFd = -1;
+  clientErr = NULL;
+  sendFrame(fd, {to_string(code & 0xff), out.str(), err.str()});
+  close(fd);
+}
+
+// requests make the daemon read any file it can, so only its own user's
+bool ownPeer(int fd) {
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    cerr << "-- cannot get peer credentials: " << strerror(errno) << endl;
+    return false;
+  }
+  if (cred.uid != getuid()) {
+    cerr << "-- refusing request of uid " << cred.uid << endl;
+    return false;
+  }
+  return true;
+}
+
+bool address(const string &sockpath, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sockpath.size() >= sizeof(addr.sun_path)) {
+    cerr << "-- socket path too long: " << sockpath << endl;
+    return false;
+  }
+  strcpy(addr.sun_path, sockpath.c_str());
+  return true;
+}
+}
+
+namespace icfd {
+int serve(const string &sockpath) {
+  sockaddr_un addr;
+  if (not address(sockpath, addr)) {
+    return -1;
+  }
+  struct stat st;
+  if (lstat(sockpath.c_str(), &st) == 0) { // a daemon's left behind
+    if (not S_ISSOCK(st.st_mode)) {
+      cerr << "-- not a socket, leaving it: " << sockpath << endl;
+      return -1;
+    }
+    unlink(sockpath.c_str());
+  }
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t mask = umask(077); // 0600 from the start, for no one else to connect
+  bool bound = lfd >= 0 and bind(lfd, (sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (not bound or listen(lfd, 64) < 0) {
+    cerr << "-- cannot listen on " << sockpath << ": " << strerror(errno)
+         << endl;
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  atexit(replyOnExit);
+  // worker owns the resident trees; a bad icf takes down the worker only
+  while (true) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      cerr << "-- cannot fork worker: " << strerror(errno) << endl;
+      return -1;
+    }
+    if (pid == 0) {
+      while (true) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd >= 0 and not ownPeer(fd)) {
+          close(fd);
+        } else if (fd >= 0) {
+          handle(fd);
+        } else if (errno != EINTR) {
+          cerr << "-- accept failed: " << strerror(errno) << endl;
+          exit(-1);
+        }
+      }
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 and errno == EINTR) {
+    }
+    cerr << "-- worker " << pid << " exited, restarting" << endl;
+  }
+}
+
+int request(const string &sockpath, const vector<string> &args) {
+  sockaddr_un addr;
+  if (not address(sockpath, addr)) {
+    return -1;
+  }
+  // files are named relative to it, here as they would be without daemon
+  char pathbuf[MAXPATHLEN];
+  if (getcwd(pathbuf, sizeof(pathbuf)) == NULL) {
+    cerr << "-- cannot get current dir: " << strerror(errno) << endl;
+    return 0xff;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 or connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  vector<string> req = {args[0], pathbuf, ""};
+  size_t nenv = 0;
+  for (auto &e : FORWARDED) {
+    char *v = getenv(e);
+    if (v) {
+      req.push_back(string(e) + '=' + v);
+      nenv++;
+    }
+  }
+  req[2] = to_string(nenv);
+  req.insert(end(req), begin(args) + 1, end(args));
+  vector<string> rep;
+  signal(SIGPIPE, SIG_IGN);
+  bool ok = sendFrame(fd, req) and recvFrame(fd, rep) and rep.size() == 3;
+  close(fd);
+  if (not ok) {
+    return -1;
+  }
+  cout << rep[1];
+  cerr << rep[2];
+  return atoi(rep[0].c_str());
+}
+}
@@ -0,0 +1,16 @@
+#ifndef __ICF_DAEMON_HPP__
+#define __ICF_DAEMON_HPP__
+
+#include <string>
+#include <vector>
+
+// resident icfdiff: parsed trees are kept in memory and revalidated by mtime
+// of every file read; requests are { validate f1 | diff f1 f2 |
+// query f1 sections key [symbol] } sent over a unix domain socket
+namespace icfd {
+int serve(const std::string &sockpath);
+// returns exit code of the request, or -1 if daemon cannot be reached
+int request(const std::string &sockpath, const std::vector<std::string> &args);
+}
+
+#endif
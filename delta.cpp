@@ -0,0 +1,454 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <assert.h>
+#include "util.hpp"
+#include "groupexpr.hpp"
+#include "delta.hpp"
+
+using namespace std;
+
+namespace {
+const string SNAPSHOT = "ICFSNAP1";
+const string DELTA = "ICFDELT1";
+
+// varints, and each string or origin written in full only the first time,
+// then as an index: a tree with few distinct values is small
+class Writer {
+  ostream &out_;
+  unordered_map<string, size_t> strings_;
+  unordered_map<Icf::Origin, size_t> origins_;
+
+public:
+  explicit Writer(ostream &out) : out_(out) {}
+  void num(unsigned long long n) {
+    while (n >= 0x80) {
+      out_.put(char(n | 0x80));
+      n >>= 7;
+    }
+    out_.put(char(n));
+  }
+  void u64(unsigned long long n) {
+    for (int i = 0; i < 8; ++i) {
+      out_.put(char(n >> (8 * i)));
+    }
+  }
+  void str(const string &s) {
+    auto itr = strings_.find(s);
+    if (itr != strings_.end()) {
+      num(itr->second + 1);
+      return;
+    }
+    num(0);
+    num(s.size());
+    out_.write(s.data(), s.size());
+    strings_.emplace(s, strings_.size());
+  }
+  template <typename C> void strs(const C &c) {
+    num(c.size());
+    for (auto &s : c) {
+      str(s);
+    }
+  }
+  // 0: none, 1: file line groupdesc, 2: mine other reverse of a diff,
+  // 3 + index of one written before
+  void origin(Icf::Origin o) {
+    if (o == Icf::NOORIGIN) {
+      num(0);
+      return;
+    }
+    auto itr = origins_.find(o);
+    if (itr != origins_.end()) {
+      num(itr->second + 3);
+      return;
+    }
+    auto &p = Icf::provenance(o);
+    if (p.other != Icf::NOORIGIN) {
+      num(2);
+      origin(Icf::origin(*p.file, p.line, *p.groupdesc));
+      origin(p.other);
+      num(p.reverse);
+    } else {
+      num(1);
+      str(*p.file);
+      num(p.line);
+      str(*p.groupdesc);
+    }
+    origins_.emplace(o, origins_.size());
+  }
+};
+
+class Reader {
+  istream &in_;
+  const char *what_;
+  vector<string> strings_;
+  vector<Icf::Origin> origins_;
+  unsigned long long left_; // bytes not read yet, or a limit off a pipe
+  bool sized_;
+
+  void bad() {
+    cerr << "-- truncated or bad " << what_ << endl;
+    exit(-1);
+  }
+  int get() {
+    int c = in_.get();
+    if (c != EOF) {
+      read(1);
+    }
+    return c;
+  }
+  void read(size_t n) {
+    if (sized_) {
+      left_ -= min<unsigned long long>(left_, n);
+    }
+  }
+
+public:
+  Reader(istream &in, const char *what)
+      : in_(in), what_(what), left_(1ULL << 30), sized_(false) {
+    auto pos = in_.tellg();
+    if (pos >= 0 and in_.seekg(0, ios::end)) {
+      left_ = in_.tellg() - pos;
+      sized_ = in_.seekg(pos).good();
+    }
+    in_.clear();
+  }
+  void magic(const string &m) {
+    string got(m.size(), '\0');
+    if (not in_.read(&got[0], got.size()) or got != m) {
+      cerr << "-- not a " << what_ << endl;
+      exit(-1);
+    }
+    read(got.size());
+  }
+  // a length or count more than the bytes left is bad, as each counted
+  // thing takes a byte at least: no allocating what a bad varint says
+  unsigned long long count() {
+    auto n = num();
+    if (n > left_) {
+      bad();
+    }
+    return n;
+  }
+  unsigned long long num() {
+    unsigned long long n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      int c = get();
+      if (c == EOF) {
+        bad();
+      }
+      n |= (unsigned long long)(c & 0x7f) << shift;
+      if (not(c & 0x80)) {
+        return n;
+      }
+    }
+    bad();
+    return 0;
+  }
+  unsigned long long u64() {
+    unsigned long long n = 0;
+    for (int i = 0; i < 8; ++i) {
+      int c = get();
+      if (c == EOF) {
+        bad();
+      }
+      n |= (unsigned long long)(unsigned char)c << (8 * i);
+    }
+    return n;
+  }
+  string str() {
+    auto n = num();
+    if (n > strings_.size()) {
+      bad();
+    }
+    if (n > 0) {
+      return strings_[n - 1];
+    }
+    string s(count(), '\0');
+    if (not s.empty() and not in_.read(&s[0], s.size())) {
+      bad();
+    }
+    read(s.size());
+    strings_.push_back(s);
+    return s;
+  }
+  template <typename F> void strs(F f) {
+    for (auto n = count(); n > 0; --n) {
+      f(str());
+    }
+  }
+  Icf::Origin origin() {
+    auto n = num();
+    Icf::Origin o = Icf::NOORIGIN;
+    if (n == 1) {
+      auto file = str();
+      unsigned line = num();
+      o = Icf::origin(file, line, str());
+    } else if (n == 2) {
+      auto mine = origin();
+      auto other = origin();
+      o = Icf::origin(mine, other, num() != 0);
+    } else if (n >= 3 and n - 3 < origins_.size()) {
+      return origins_[n - 3];
+    } else if (n != 0) {
+      bad();
+    }
+    if (n != 0) {
+      origins_.push_back(o);
+    }
+    return o;
+  }
+};
+
+// what is in to and not in from, then what is in from and not in to
+void setDelta(Writer &w, const Icf::Set &from, const Icf::Set &to) {
+  Icf::Set added, removed;
+  set_difference(begin(to), end(to), begin(from), end(from),
+                 inserter(added, begin(added)));
+  set_difference(begin(from), end(from), begin(to), end(to),
+                 inserter(removed, begin(removed)));
+  w.strs(added);
+  w.strs(removed);
+}
+
+void applySetDelta(Reader &r, Icf::Set &s) {
+  r.strs([&](const string &a) { s.insert(a); });
+  r.strs([&](const string &a) { s.erase(a); });
+}
+}
+
+// order independent, so trees of the same content have the same digest
+// whatever order their store was filled in; origins do not count, nor do
+// (A+B) groups derived from the others, so it is the same once diffed
+unsigned long long Icf::digest() const {
+  unsigned long long d = 0;
+  for (auto &kv : groups_) {
+    if (kv.first[0] == '(') {
+      continue;
+    }
+    d += sophoi::fnv1a("g\x1f" + kv.first + '\x1f' +
+                       sophoi::join("\x1f", begin(kv.second), end(kv.second)));
+  }
+  for (auto &c : conjunctions_) {
+    d += sophoi::fnv1a("c\x1f" + c);
+  }
+  for (auto &s : icfSections_) {
+    d += sophoi::fnv1a("s\x1f" + s);
+  }
+  for (auto &ks : store_) {
+    auto k = "v\x1f" + ks.first.first + '\x1f' + ks.first.second + '\x1f';
+    for (auto &sv : ks.second) {
+      d += sophoi::fnv1a(k + sv.first + '\x1f' + sv.second.first);
+    }
+  }
+  return d;
+}
+
+// groups, conjunctions, sections and store of a tree as parsed; derived
+// groups are made again once needed
+void Icf::snapshot_to(std::ostream &output) const {
+  assert(not derived_);
+  output << SNAPSHOT;
+  Writer w(output);
+  w.num(groups_.size());
+  for (auto &kv : groups_) {
+    w.str(kv.first);
+    w.strs(kv.second);
+  }
+  w.strs(conjunctions_);
+  w.strs(icfSections_);
+  w.num(store_.size());
+  for (auto &ks : store_) {
+    w.str(ks.first.first);
+    w.str(ks.first.second);
+    w.num(ks.second.size());
+    for (auto &sv : ks.second) {
+      w.str(sv.first);
+      w.str(sv.second.first);
+      w.origin(sv.second.second);
+    }
+  }
+}
+
+Icf Icf::loadSnapshot(std::istream &input) {
+  Icf icf;
+  icf.opts_.reset(new Options());
+  icf.exprs_.reset(new groupexpr::Cache());
+  Reader r(input, "icf snapshot");
+  r.magic(SNAPSHOT);
+  for (auto n = r.count(); n > 0; --n) {
+    auto &members = icf.groups_[r.str()];
+    r.strs([&](const string &m) { members.insert(end(members), m); });
+  }
+  r.strs([&](const string &c) { icf.conjunctions_.insert(c); });
+  r.strs([&](const string &s) { icf.icfSections_.insert(s); });
+  for (auto nk = r.count(); nk > 0; --nk) {
+    auto sections = r.str();
+    auto &symbols = icf.store_[make_pair(sections, r.str())];
+    for (auto ns = r.count(); ns > 0; --ns) {
+      auto sym = r.str();
+      auto value = r.str();
+      symbols.emplace_hint(end(symbols), sym, make_pair(value, r.origin()));
+    }
+  }
+  return icf;
+}
+
+// what turns this tree into newicf: groups set or gone, conjunctions and
+// sections added or gone, and per key the symbols set to a new value or gone;
+// digests of both make sure it is only applied to this tree, and works
+void Icf::delta_to(const Icf &newicf, std::ostream &output) const {
+  assert(not derived_ and not newicf.derived_);
+  output << DELTA;
+  Writer w(output);
+  w.u64(digest());
+  w.u64(newicf.digest());
+
+  std::vector<Groups::const_iterator> set;
+  Set gone;
+  for (auto itr = begin(newicf.groups_); itr != end(newicf.groups_); ++itr) {
+    auto old = groups_.find(itr->first);
+    if (old == groups_.end() or old->second != itr->second) {
+      set.push_back(itr);
+    }
+  }
+  for (auto &kv : groups_) {
+    if (newicf.groups_.find(kv.first) == newicf.groups_.end()) {
+      gone.insert(kv.first);
+    }
+  }
+  w.num(set.size());
+  for (auto &g : set) {
+    w.str(g->first);
+    w.strs(g->second);
+  }
+  w.strs(gone);
+  setDelta(w, conjunctions_, newicf.conjunctions_);
+  setDelta(w, icfSections_, newicf.icfSections_);
+
+  typedef std::map<std::string, WithEnv> Symbols;
+  struct Change {
+    const IcfKey *k;
+    std::vector<const std::string *> gone;
+    std::vector<Symbols::const_iterator> set;
+  };
+  std::vector<Change> changes;
+  static const Symbols none;
+  for (auto &ks : newicf.store_) {
+    auto old = store_.find(ks.first);
+    auto &was = old == store_.end() ? none : old->second;
+    Change c = {&ks.first, {}, {}};
+    for (auto sv = begin(ks.second); sv != end(ks.second); ++sv) {
+      auto o = was.find(sv->first);
+      if (o == was.end() or o->second.first != sv->second.first) {
+        c.set.push_back(sv);
+      }
+    }
+    for (auto &sv : was) {
+      if (ks.second.find(sv.first) == ks.second.end()) {
+        c.gone.push_back(&sv.first);
+      }
+    }
+    if (not c.set.empty() or not c.gone.empty()) {
+      changes.push_back(std::move(c));
+    }
+  }
+  for (auto &ks : store_) {
+    if (newicf.store_.find(ks.first) == newicf.store_.end()) {
+      Change c = {&ks.first, {}, {}};
+      for (auto &sv : ks.second) {
+        c.gone.push_back(&sv.first);
+      }
+      changes.push_back(std::move(c));
+    }
+  }
+  w.num(changes.size());
+  for (auto &c : changes) {
+    w.str(c.k->first);
+    w.str(c.k->second);
+    w.num(c.gone.size());
+    for (auto s : c.gone) {
+      w.str(*s);
+    }
+    w.num(c.set.size());
+    for (auto &sv : c.set) {
+      w.str(sv->first);
+      w.str(sv->second.first);
+      w.origin(sv->second.second);
+    }
+  }
+}
+
+void Icf::apply(std::istream &delta) {
+  assert(not derived_);
+  Reader r(delta, "icf delta");
+  r.magic(DELTA);
+  auto from = r.u64(), to = r.u64();
+  if (from != digest()) {
+    cerr << "-- delta is not of this tree" << endl;
+    exit(-1);
+  }
+  for (auto n = r.count(); n > 0; --n) {
+    auto &members = groups_[r.str()];
+    members.clear();
+    r.strs([&](const string &m) { members.insert(end(members), m); });
+  }
+  r.strs([&](const string &g) { groups_.erase(g); });
+  groupsChanged();
+  applySetDelta(r, conjunctions_);
+  applySetDelta(r, icfSections_);
+  for (auto nk = r.count(); nk > 0; --nk) {
+    auto sections = r.str();
+    auto k = make_pair(sections, r.str());
+    auto &symbols = store_[k];
+    r.strs([&](const string &s) { symbols.erase(s); });
+    for (auto ns = r.count(); ns > 0; --ns) {
+      auto sym = r.str();
+      auto value = r.str();
+      symbols[sym] = make_pair(value, r.origin());
+    }
+    if (symbols.empty()) {
+      store_.erase(k);
+    }
+  }
+  if (digest() != to) {
+    cerr << "-- delta applied does not give the tree it was made for" << endl;
+    exit(-1);
+  }
+}
+
+namespace icfdelta {
+Icf load(const string &fname) {
+  ifstream in(fname, ios::binary);
+  string magic(SNAPSHOT.size(), '\0');
+  if (in.read(&magic[0], magic.size()) and magic == SNAPSHOT) {
+    in.seekg(0);
+    return Icf::loadSnapshot(in);
+  }
+  return Icf(fname.c_str());
+}
+
+int snapshot(const string &fname) {
+  load(fname).snapshot_to(cout);
+  return 0;
+}
+
+int delta(const string &oldf, const string &newf) {
+  Icf old = load(oldf);
+  Icf neu = load(newf);
+  old.delta_to(neu, cout);
+  return 0;
+}
+
+int apply(const string &base, const string &deltaf) {
+  Icf icf = load(base);
+  ifstream in(deltaf, ios::binary);
+  if (in.fail()) {
+    cerr << "-- cannot read delta: " << deltaf << endl;
+    exit(-1);
+  }
+  icf.apply(in);
+  icf.snapshot_to(cout);
+  return 0;
+}
+}
@@ -0,0 +1,18 @@
+#ifndef __ICF_DELTA_HPP__
+#define __ICF_DELTA_HPP__
+
+#include <string>
+#include "icf.hpp"
+
+// binary snapshots of parsed trees and deltas between them, so a change is
+// shipped and applied without the text of whole trees
+namespace icfdelta {
+// an .icf file, or a snapshot written by --snapshot
+Icf load(const std::string &fname);
+// each writes to stdout
+int snapshot(const std::string &fname);
+int delta(const std::string &oldf, const std::string &newf);
+int apply(const std::string &base, const std::string &deltaf);
+}
+
+#endif
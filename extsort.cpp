@@ -0,0 +1,296 @@
+#include <iostream>
+#include <algorithm>
+#include <queue>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "extsort.hpp"
+
+using namespace std;
+
+namespace {
+using extsort::Rec;
+
+int compareHeader(const Rec &a, const Rec &b) {
+  return a.sections.compare(0, a.hlen, b.sections, 0, b.hlen);
+}
+
+void put(FILE *f, const string &s) {
+  uint32_t len = s.size();
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(s.data(), 1, len, f);
+}
+
+bool get(FILE *f, string &s) {
+  uint32_t len;
+  if (fread(&len, sizeof(len), 1, f) != 1) {
+    return false;
+  }
+  s.resize(len);
+  return len == 0 or fread(&s[0], 1, len, f) == len;
+}
+
+void write(FILE *f, const Rec &r) {
+  put(f, r.sections);
+  put(f, r.key);
+  put(f, r.sym);
+  put(f, r.value);
+  fwrite(&r.env, sizeof(r.env), 1, f);
+  fwrite(&r.seq, sizeof(r.seq), 1, f);
+}
+
+bool read(FILE *f, Rec &r) {
+  if (not get(f, r.sections)) {
+    return false;
+  }
+  if (not(get(f, r.key) and get(f, r.sym) and get(f, r.value) and
+          fread(&r.env, sizeof(r.env), 1, f) == 1 and fread(&r.seq, sizeof(r.seq), 1, f) == 1)) {
+    cerr << "-- truncated spill run" << endl;
+    exit(-1);
+  }
+  r.hlen = min(r.sections.find(':'), r.sections.size());
+  return true;
+}
+
+// runs merged at once, so each record is rewritten once per level and no
+// more than FAN_IN files per level are open
+const size_t FAN_IN = 16;
+
+FILE *tmpRun() {
+  const char *tmpdir = getenv("TMPDIR");
+  string tmpl = string(tmpdir ? tmpdir : "/tmp") + "/icfdiff.XXXXXX";
+  int fd = mkstemp(&tmpl[0]);
+  FILE *f = fd < 0 ? NULL : fdopen(fd, "w+b");
+  if (f == NULL) {
+    cerr << "-- cannot create spill file " << tmpl << ": " << strerror(errno)
+         << endl;
+    exit(-1);
+  }
+  unlink(tmpl.c_str()); // goes away with the last close
+  return f;
+}
+
+void done(FILE *f) {
+  if (fflush(f) != 0) {
+    cerr << "-- cannot write spill file: " << strerror(errno) << endl;
+    exit(-1);
+  }
+}
+
+class MemStream : public extsort::Stream {
+  vector<Rec> recs_;
+  size_t pos_ = 0;
+
+public:
+  explicit MemStream(vector<Rec> &recs) { recs_.swap(recs); }
+  bool next(Rec &r) {
+    if (pos_ >= recs_.size()) {
+      return false;
+    }
+    r = move(recs_[pos_++]);
+    return true;
+  }
+};
+
+// k-way merge of sorted runs
+class RunStream : public extsort::Stream {
+  struct Head {
+    Rec rec;
+    size_t run;
+  };
+  struct Later {
+    bool operator()(const Head *a, const Head *b) const {
+      return b->rec < a->rec;
+    }
+  };
+  vector<FILE *> runs_;
+  vector<Head> heads_;
+  priority_queue<Head *, vector<Head *>, Later> queue_;
+
+public:
+  explicit RunStream(const vector<FILE *> &runs) : runs_(runs) {
+    heads_.resize(runs_.size());
+    for (size_t i = 0; i < runs_.size(); ++i) {
+      rewind(runs_[i]);
+      heads_[i].run = i;
+      if (read(runs_[i], heads_[i].rec)) {
+        queue_.push(&heads_[i]);
+      }
+    }
+  }
+  bool next(Rec &r) {
+    if (queue_.empty()) {
+      return false;
+    }
+    Head *h = queue_.top();
+    queue_.pop();
+    r = h->rec;
+    if (read(runs_[h->run], h->rec)) {
+      queue_.push(h);
+    }
+    return true;
+  }
+};
+}
+
+namespace extsort {
+bool operator<(const Rec &a, const Rec &b) {
+  int c = groupCompare(a, b);
+  if (c != 0) {
+    return c < 0;
+  }
+  c = a.sections.compare(b.sections);
+  return c != 0 ? c < 0 : a.seq < b.seq;
+}
+
+int groupCompare(const Rec &a, const Rec &b) {
+  int c = compareHeader(a, b);
+  if (c == 0) {
+    c = a.key.compare(b.key);
+  }
+  if (c == 0) {
+    c = a.sym.compare(b.sym);
+  }
+  return c;
+}
+
+Spiller::Spiller(size_t budget) : budget_(budget) {}
+
+Spiller::~Spiller() {
+  keys_.reset();
+  for (auto &runs : {&runs_, &keyRuns_}) {
+    for (auto &r : *runs) {
+      fclose(r.file);
+    }
+  }
+}
+
+void Spiller::addKey(const Icf::IcfKey &k) {
+  if (keyBuf_.insert(k).second) {
+    bytes_ += sizeof(Icf::IcfKey) + k.first.size() + k.second.size();
+  }
+}
+
+void Spiller::add(const Icf::IcfKey &k, const std::string &sym,
+                  const std::string &value, Icf::Origin env) {
+  addKey(k);
+  Rec r = {k.first, k.second, sym, value, env, seq_++,
+           min(k.first.find(':'), k.first.size())};
+  bytes_ += sizeof(Rec) + r.sections.size() + r.key.size() + r.sym.size() +
+            r.value.size();
+  buf_.push_back(move(r));
+  if (bytes_ > budget_) {
+    spill();
+  }
+}
+
+void Spiller::spill() {
+  if (buf_.empty() and keyBuf_.empty()) {
+    return;
+  }
+  sort(begin(buf_), end(buf_));
+  FILE *f = tmpRun();
+  for (auto &r : buf_) {
+    write(f, r);
+  }
+  done(f);
+  vector<Rec>().swap(buf_);
+  push(runs_, f, false);
+  auto keys = takeKeys();
+  f = tmpRun();
+  for (auto &r : keys) {
+    write(f, r);
+  }
+  done(f);
+  push(keyRuns_, f, true);
+  bytes_ = 0;
+}
+
+// keys met since the last spill as sorted records, dropped from memory
+vector<Rec> Spiller::takeKeys() {
+  vector<Rec> keys;
+  for (auto &k : keyBuf_) {
+    keys.push_back(Rec{k.first, k.second, "", "", Icf::NOORIGIN, 0,
+                       min(k.first.find(':'), k.first.size())});
+  }
+  decltype(keyBuf_)().swap(keyBuf_);
+  sort(begin(keys), end(keys));
+  return keys;
+}
+
+// size tiered: FAN_IN runs of one level, the newest ones, merge into one of
+// the next, so a record is rewritten log(runs) times rather than once per
+// FAN_IN spills; keys met again in another run are written once
+void Spiller::push(vector<Run> &runs, FILE *f, bool keys) {
+  runs.push_back(Run{f, 0});
+  while (runs.size() >= FAN_IN and
+         runs[runs.size() - FAN_IN].level == runs.back().level) {
+    vector<FILE *> files;
+    for (auto r = end(runs) - FAN_IN; r != end(runs); ++r) {
+      files.push_back(r->file);
+    }
+    FILE *m = tmpRun();
+    RunStream in(files);
+    Rec r, last;
+    bool any = false;
+    while (in.next(r)) {
+      if (keys and any and r.sections == last.sections and r.key == last.key) {
+        continue;
+      }
+      write(m, r);
+      if (keys) {
+        last = r;
+        any = true;
+      }
+    }
+    done(m);
+    for (auto run : files) {
+      fclose(run);
+    }
+    unsigned level = runs.back().level + 1;
+    runs.resize(runs.size() - FAN_IN);
+    runs.push_back(Run{m, level});
+  }
+}
+
+std::unique_ptr<Stream> Spiller::sorted() {
+  if (runs_.empty()) {
+    auto keys = takeKeys();
+    keys_.reset(new MemStream(keys));
+    sort(begin(buf_), end(buf_));
+    return unique_ptr<Stream>(new MemStream(buf_));
+  }
+  spill();
+  vector<FILE *> files, keyFiles;
+  for (auto &r : runs_) {
+    files.push_back(r.file);
+  }
+  for (auto &r : keyRuns_) {
+    keyFiles.push_back(r.file);
+  }
+  keys_.reset(new RunStream(keyFiles));
+  return unique_ptr<Stream>(new RunStream(files));
+}
+
+bool Spiller::hasKey(const Icf::IcfKey &k) {
+  Rec at = {k.first, k.second, "", "", Icf::NOORIGIN, 0,
+            min(k.first.find(':'), k.first.size())};
+  if (not keyAtSet_ or groupCompare(at, keyAt_) != 0) {
+    if (not keyAtSet_) {
+      keyHas_ = keys_->next(keyCur_);
+      keyAtSet_ = true;
+    }
+    while (keyHas_ and groupCompare(keyCur_, at) < 0) {
+      keyHas_ = keys_->next(keyCur_);
+    }
+    keySections_.clear();
+    while (keyHas_ and groupCompare(keyCur_, at) == 0) {
+      keySections_.insert(keyCur_.sections);
+      keyHas_ = keys_->next(keyCur_);
+    }
+    keyAt_ = at;
+  }
+  return keySections_.find(k.first) != keySections_.end();
+}
+}
@@ -0,0 +1,74 @@
+#ifndef __ICF_EXTSORT_HPP__
+#define __ICF_EXTSORT_HPP__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include <stdio.h>
+#include "icf.hpp"
+
+// records of a tree spilled to sorted runs on disk as they are parsed, read
+// back as one sorted stream for a merge-join diff
+namespace extsort {
+struct Rec {
+  std::string sections, key, sym, value;
+  Icf::Origin env;
+  unsigned long long seq; // parse order, decides which record wins
+  size_t hlen;            // length of header, the sections part before ':'
+};
+// order by (header, key, symbol, sections, seq): everything a symbol's diff
+// on one key needs, sub-keys included, comes together
+bool operator<(const Rec &a, const Rec &b);
+// compare (header, key, symbol) only
+int groupCompare(const Rec &a, const Rec &b);
+
+class Stream {
+public:
+  virtual ~Stream() {}
+  virtual bool next(Rec &r) = 0;
+};
+
+class Spiller {
+public:
+  explicit Spiller(size_t budget); // bytes of records held before a spill
+  ~Spiller();
+  Spiller(const Spiller &) = delete;
+  Spiller &operator=(const Spiller &) = delete;
+
+  void add(const Icf::IcfKey &k, const std::string &sym,
+           const std::string &value, Icf::Origin env);
+  // k defined, for symbols not added
+  void addKey(const Icf::IcfKey &k);
+  // all records added so far, in Rec order; call once parsing is done
+  std::unique_ptr<Stream> sorted();
+  // whether k was added, for any symbol; after sorted(), with keys asked in
+  // (header, key) order, as a merge over the sorted streams reaches them
+  bool hasKey(const Icf::IcfKey &k);
+
+private:
+  struct Run {
+    FILE *file;
+    unsigned level; // merged from FAN_IN runs of the level below
+  };
+  void spill();
+  void push(std::vector<Run> &runs, FILE *f, bool keys);
+  std::vector<Rec> takeKeys();
+
+  size_t budget_;
+  size_t bytes_ = 0;
+  unsigned long long seq_ = 0;
+  std::vector<Rec> buf_;
+  std::vector<Run> runs_;
+  // keys met since the last spill, spilled to runs of their own, sorted, with
+  // empty symbol and value; read back a (header, key) at a time
+  std::unordered_set<Icf::IcfKey, Icf::Hasher, Icf::Equaler> keyBuf_;
+  std::vector<Run> keyRuns_;
+  std::unique_ptr<Stream> keys_;
+  Rec keyCur_, keyAt_;
+  bool keyHas_ = false, keyAtSet_ = false;
+  std::unordered_set<std::string> keySections_; // with keyAt_'s (header, key)
+};
+}
+
+#endif
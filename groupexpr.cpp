@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <iterator>
+#include "util.hpp"
+#include "groupexpr.hpp"
+
+using namespace std;
+
+namespace {
+using groupexpr::Node;
+using groupexpr::Groups;
+typedef shared_ptr<const Node> NodeP;
+
+struct Tok {
+  char op; // '+', '-', '^', '(', ')', or 0 for a name
+  string name;
+};
+
+bool isOp(char c) { return c == '+' or c == '^' or c == '(' or c == ')'; }
+
+void addName(const string &run, const Groups &groups, vector<Tok> &toks) {
+  if (run.find('-') == string::npos or groups.find(run) != groups.end()) {
+    toks.push_back({0, run});
+    return;
+  }
+  auto parts = sophoi::split(run, "-");
+  bool grouped = false;
+  for (auto &p : parts) {
+    grouped = grouped or groups.find(p) != groups.end();
+  }
+  if (not grouped) { // BRK-B
+    toks.push_back({0, run});
+    return;
+  }
+  for (size_t i = 0; i < run.size();) {
+    auto d = run.find('-', i);
+    if (d != i) {
+      toks.push_back({0, run.substr(i, d == string::npos ? d : d - i)});
+    }
+    if (d == string::npos) {
+      break;
+    }
+    toks.push_back({'-', ""});
+    i = d + 1;
+  }
+}
+
+vector<Tok> tokenize(const string &text, const Groups &groups) {
+  vector<Tok> toks;
+  string run;
+  for (size_t i = 0; i <= text.size(); ++i) {
+    char c = i < text.size() ? text[i] : ' ';
+    bool ws = c == ' ' or c == '\t';
+    if ((ws or isOp(c) or (c == '-' and run.empty()))) {
+      if (not run.empty()) {
+        addName(run, groups, toks);
+        run.clear();
+      }
+      if (not ws) {
+        toks.push_back({c, ""});
+      }
+    } else {
+      run += c;
+    }
+  }
+  return toks;
+}
+
+NodeP combine(char op, NodeP l, NodeP r) {
+  auto n = make_shared<Node>();
+  n->op = op;
+  for (auto &k : {l, r}) {
+    if (op != '-' and k->op == op) { // A+(B+C) is A+B+C
+      n->kids.insert(end(n->kids), begin(k->kids), end(k->kids));
+    } else {
+      n->kids.push_back(k);
+    }
+  }
+  vector<string> norms;
+  for (auto &k : n->kids) {
+    norms.push_back(k->norm);
+  }
+  if (op != '-') {
+    sort(begin(norms), end(norms));
+    norms.erase(unique(begin(norms), end(norms)), end(norms));
+  }
+  n->norm = string(1, op) + '(' + sophoi::join(" ", begin(norms), end(norms)) +
+            ')';
+  return n;
+}
+
+class Parser {
+  const vector<Tok> &toks_;
+  size_t pos_ = 0;
+
+  bool at(char op) const { return pos_ < toks_.size() and toks_[pos_].op == op; }
+
+  NodeP atom(string &err) {
+    if (at('(')) {
+      pos_++;
+      auto n = expr(err);
+      if (n and not at(')')) {
+        err = "missing ')'";
+        return NULL;
+      }
+      pos_++;
+      return n;
+    }
+    if (pos_ >= toks_.size() or toks_[pos_].op != 0) {
+      err = pos_ < toks_.size() ? string("unexpected '") + toks_[pos_].op + "'"
+                                : "missing operand";
+      return NULL;
+    }
+    auto n = make_shared<Node>();
+    n->op = 0;
+    n->name = n->norm = toks_[pos_++].name;
+    return n;
+  }
+
+  NodeP term(string &err) {
+    auto n = atom(err);
+    while (n and at('^')) {
+      pos_++;
+      auto r = atom(err);
+      n = r ? combine('^', n, r) : NULL;
+    }
+    return n;
+  }
+
+public:
+  explicit Parser(const vector<Tok> &toks) : toks_(toks) {}
+  bool done() const { return pos_ == toks_.size(); }
+
+  NodeP expr(string &err) {
+    auto n = term(err);
+    while (n and (at('+') or at('-'))) {
+      char op = toks_[pos_++].op;
+      auto r = term(err);
+      n = r ? combine(op, n, r) : NULL;
+    }
+    return n;
+  }
+};
+}
+
+namespace groupexpr {
+shared_ptr<const Node> parse(const string &text, const Groups &groups,
+                             string &err) {
+  auto toks = tokenize(text, groups);
+  Parser p(toks);
+  auto n = p.expr(err);
+  if (n and not p.done()) { // a name or ')' after a complete expression
+    err = "unexpected trailing input";
+    return NULL;
+  }
+  return n;
+}
+
+bool hasGroup(const Node &n, const Groups &groups) {
+  if (n.op == 0) {
+    return groups.find(n.name) != groups.end();
+  }
+  for (auto &k : n.kids) {
+    if (hasGroup(*k, groups)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool namesGroup(const string &text, const Groups &groups) {
+  for (auto &t : tokenize(text, groups)) {
+    if (t.op == 0 and groups.find(t.name) != groups.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const Set *Cache::eval(const string &text, const Groups &groups,
+                       string &err) {
+  auto itr = byText_.find(text);
+  if (itr != byText_.end()) {
+    return itr->second;
+  }
+  auto n = parse(text, groups, err);
+  if (not n) {
+    return NULL;
+  }
+  const Set *s = hasGroup(*n, groups) ? &eval(*n, groups) : NULL;
+  byText_[text] = s;
+  return s;
+}
+
+const Set &Cache::eval(const Node &n, const Groups &groups) {
+  if (n.op == 0) {
+    auto g = groups.find(n.name);
+    if (g != groups.end()) {
+      return g->second;
+    }
+  }
+  auto itr = byNorm_.find(n.norm);
+  if (itr != byNorm_.end()) {
+    return itr->second;
+  }
+  Set s;
+  if (n.op == 0) {
+    s.insert(n.name);
+  } else {
+    s = eval(*n.kids[0], groups);
+    for (size_t i = 1; i < n.kids.size(); ++i) {
+      auto &k = eval(*n.kids[i], groups);
+      Set r;
+      if (n.op == '+') {
+        set_union(begin(s), end(s), begin(k), end(k), inserter(r, begin(r)));
+      } else if (n.op == '^') {
+        set_intersection(begin(s), end(s), begin(k), end(k),
+                         inserter(r, begin(r)));
+      } else {
+        set_difference(begin(s), end(s), begin(k), end(k),
+                       inserter(r, begin(r)));
+      }
+      s.swap(r);
+    }
+  }
+  return byNorm_[n.norm] = s;
+}
+
+void Cache::clear() {
+  byText_.clear();
+  byNorm_.clear();
+}
+}
@@ -0,0 +1,50 @@
+#ifndef __ICF_GROUPEXPR_HPP__
+#define __ICF_GROUPEXPR_HPP__
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+
+// group expressions: names joined by + (union), - (difference) and ^
+// (intersection, binds tighter), with parentheses; a name not a group is an
+// item, and a name with '-' in it, like BRK-B, is an item too unless one of
+// its parts is a group
+namespace groupexpr {
+typedef std::set<std::string> Set;
+typedef std::map<std::string, Set> Groups;
+
+struct Node {
+  char op;                // '+', '-', '^', or 0 for a name
+  std::string name;       // of a name
+  std::string norm;       // operands of + and ^ sorted: same set, same norm
+  std::vector<std::shared_ptr<const Node>> kids;
+};
+
+// NULL with err set on bad syntax; groups only decide how '-' splits names
+std::shared_ptr<const Node> parse(const std::string &text,
+                                  const Groups &groups, std::string &err);
+bool hasGroup(const Node &n, const Groups &groups);
+// whether any name in text is a group, parsed or not: if none, text that does
+// not parse, like ES+ or X(1), is an item rather than a bad expression
+bool namesGroup(const std::string &text, const Groups &groups);
+
+// sets of expressions and of all their subexpressions, by normalized text,
+// so a composite group used again, or spelled another way, is a lookup;
+// clear() once groups change
+class Cache {
+public:
+  // NULL if text names no group (an item then), or is bad with err set
+  const Set *eval(const std::string &text, const Groups &groups,
+                  std::string &err);
+  const Set &eval(const Node &n, const Groups &groups);
+  void clear();
+
+private:
+  std::map<std::string, const Set *> byText_;
+  std::map<std::string, Set> byNorm_;
+};
+}
+
+#endif
@@ -2,11 +2,22 @@
 #include <fstream>
 #include <algorithm>
 #include <iterator>
-#include <random>
+#include <atomic>
+#include <mutex>
+#include <tuple>
 #include <assert.h>
+#include <sys/stat.h>
 #include "util.hpp"
 #include "icf.hpp"
 #include "path.hpp"
+#include "lexer.hpp"
+#include "extsort.hpp"
+#include "groupexpr.hpp"
+#include "prefetch.hpp"
+#include "trace.hpp"
+#include "profile.hpp"
+#include "archive.hpp"
+#include "symlist.hpp"
 
 using namespace std;
 
@@ -14,12 +25,16 @@ namespace detail {
 char INCLUDE[] = "#include";
 char GROUPDEF[] = "#groupdef";
 char ENDGROUPDEF[] = "#endgroupdef";
+char GROUPEXPR[] = "#groupexpr";
+char GROUPFILE[] = "#groupfile";
 std::map<char *, size_t> sharps = {
     {INCLUDE, sizeof(INCLUDE) - 1}, // sizeof includes \0
     {GROUPDEF, sizeof(GROUPDEF) - 1},
-    {ENDGROUPDEF, sizeof(ENDGROUPDEF) - 1}};
+    {ENDGROUPDEF, sizeof(ENDGROUPDEF) - 1},
+    {GROUPEXPR, sizeof(GROUPEXPR) - 1},
+    {GROUPFILE, sizeof(GROUPFILE) - 1}};
 
-string trim(const string &line, bool sharpen = false) {
+string trim(const string &line, bool sharpen) {
   size_t start = line.find_first_not_of(" \t\n\r");
   // look for #include / #groupdef etc.
   for (auto &kv : sharps) {
@@ -52,31 +67,274 @@ string trim(const string &line, bool sharpen = false) {
 }
 }
 
-std::vector<std::string> getGrpNamCombs() {
-  static std::vector<std::string> gnc;
-  if (gnc.size() > 0) {
-    return gnc;
+namespace {
+// provenances of all trees of the process: appended under a lock, read
+// without one, as chunks never move once allocated and an id is only handed
+// out after its entry is written
+class OriginTable {
+  static const size_t CHUNK = 1 << 16, CHUNKS = 1 << 16;
+  std::atomic<Icf::Provenance *> chunks_[CHUNKS];
+  std::mutex mtx_;
+  Icf::Origin next_ = Icf::NOORIGIN;
+  std::set<std::string> strings_; // interned file names and group descs
+  std::map<std::tuple<const std::string *, const std::string *, unsigned,
+                      Icf::Origin, bool>,
+           Icf::Origin> ids_;
+
+public:
+  OriginTable() {
+    for (auto &c : chunks_) {
+      c.store(NULL);
+    }
+    intern(Icf::Provenance{&*strings_.insert("").first,
+                           &*strings_.insert("").first, 0, Icf::NOORIGIN,
+                           false});
+  }
+  Icf::Origin intern(const std::string &file, unsigned line,
+                     const std::string &groupdesc) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return intern(Icf::Provenance{&*strings_.insert(file).first,
+                                  &*strings_.insert(groupdesc).first, line,
+                                  Icf::NOORIGIN, false});
+  }
+  Icf::Origin intern(Icf::Origin mine, Icf::Origin other, bool reverse) {
+    Icf::Provenance p = get(mine);
+    p.other = other;
+    p.reverse = reverse;
+    std::lock_guard<std::mutex> lock(mtx_);
+    return intern(p);
+  }
+  const Icf::Provenance &get(Icf::Origin o) const {
+    return chunks_[o / CHUNK].load(std::memory_order_acquire)[o % CHUNK];
+  }
+
+private:
+  Icf::Origin intern(const Icf::Provenance &p) { // locked
+    auto key = std::make_tuple(p.file, p.groupdesc, p.line, p.other, p.reverse);
+    auto itr = ids_.find(key);
+    if (itr != ids_.end()) {
+      return itr->second;
+    }
+    if (next_ / CHUNK >= CHUNKS) {
+      std::cerr << "-- too many value origins" << std::endl;
+      exit(-1);
+    }
+    auto chunk = chunks_[next_ / CHUNK].load(std::memory_order_relaxed);
+    if (chunk == NULL) {
+      chunk = new Icf::Provenance[CHUNK];
+      chunks_[next_ / CHUNK].store(chunk, std::memory_order_release);
+    }
+    chunk[next_ % CHUNK] = p;
+    ids_[key] = next_;
+    return next_++;
+  }
+};
+
+OriginTable &origins() {
+  static OriginTable table;
+  return table;
+}
+
+bool showOrigin() {
+  const char *so = getenv("SHOW_ORIGIN");
+  return so and *so and std::string(so) != "0";
+}
+
+bool showMoved() {
+  const char *sm = getenv("SHOW_MOVED");
+  return sm and *sm and std::string(sm) != "0";
+}
+
+bool isDefault(Icf::Origin o) {
+  return *Icf::provenance(o).groupdesc == "DEFAULT";
+}
+
+// the last value set for a symbol wins, but DEFAULT does not override a value
+// set for a group; folding records in parse order, or folding partial stores
+// of consecutive chunks in chunk order, ends the same
+void fold(Icf::Store &store, Icf::History *history, const Icf::IcfKey &k,
+          std::string sym, std::string value, Icf::Origin env) {
+  auto &symbols = store[k];
+  auto itr = symbols.find(sym);
+  if (itr == symbols.end()) {
+    itr = symbols.emplace(sym, Icf::WithEnv()).first;
+  } else if (isDefault(env) and not isDefault(itr->second.second)) {
+    return;
+  }
+  if (history) {
+    (*history)[k][sym].push_back(make_pair(value, env));
+  }
+  itr->second = make_pair(std::move(value), env);
+}
+
+const size_t PARSE_CHUNK = 1 << 20; // bytes of lines parsed by one task
+
+std::string dupMsg(const Icf::IcfKey &k, const std::string &groupdesc,
+                   unsigned first, const std::string &where) {
+  return "-- dup kv pair definition '" + k.first + ':' + k.second +
+         "' for '" + groupdesc + "' (first at line " + std::to_string(first) +
+         ") in " + where;
+}
+}
+
+const Icf::Origin Icf::NOORIGIN;
+
+Icf::Origin Icf::origin(const std::string &file, unsigned line,
+                        const std::string &groupdesc) {
+  return origins().intern(file, line, groupdesc);
+}
+
+Icf::Origin Icf::origin(Origin mine, Origin other, bool reverse) {
+  return origins().intern(mine, other, reverse);
+}
+
+const Icf::Provenance &Icf::provenance(Origin o) {
+  return origins().get(o);
+}
+
+std::string Icf::where(Origin o) {
+  auto &p = provenance(o);
+  auto at = *p.file + ':' + std::to_string(p.line);
+  if (p.other == NOORIGIN) {
+    return at;
   }
+  return p.reverse ? where(p.other) + "<->" + at : at + "<->" + where(p.other);
+}
+
+namespace {
+// GRP@4_MAD_COW[_1]; a name is picked from these by the content of its set
+std::vector<std::string> grpNamCombs() {
   std::vector<std::string> adjs = {
-      "FAT", "BAD", "RED", "GREEN", "BLUE", "RED", "MAD", "HAPPY", "SAD", "DRY",
+      "FAT", "BAD", "RED", "GREEN", "BLUE", "WET", "MAD", "HAPPY", "SAD", "DRY",
   };
   std::vector<std::string> noun = {
       "CAT", "DOG", "COW", "APPLE", "DATE", "MOON", "SUN", "MAN", "BOY", "GIRL",
   };
+  std::vector<std::string> gnc;
   for (auto &a : adjs)
     for (auto &n : noun) {
-      gnc.push_back(a + "_" + n); // GRP@4_MAD_COW[_1]
+      gnc.push_back(a + "_" + n);
     }
-  std::random_device rd;
-  std::mt19937_64 gen(rd());
-  std::shuffle(begin(gnc), end(gnc), gen);
   return gnc;
 }
+const std::vector<std::string> &getGrpNamCombs() {
+  static const std::vector<std::string> gnc = grpNamCombs();
+  return gnc;
+}
+}
+
+struct Icf::Sink {
+  virtual ~Sink() {}
+  // symbols groupdesc expands to, empty if it is a single symbol
+  virtual const Set &symbols(const std::string &groupdesc) = 0;
+  virtual void record(const IcfKey &k, const std::string &sym,
+                      const std::string &value, Origin env) = 0;
+  virtual void section(const std::string &sections) = 0;
+  // k is defined for a symbol not kept, see Options::keepSymbol
+  virtual void present(const IcfKey &k) = 0;
+  // under validate mode: k defined for groupdesc, twice is an error
+  virtual void define(const IcfKey &k, const std::string &groupdesc,
+                      unsigned lineno, const sophoi::LexLine &lex) = 0;
+  virtual void fail(unsigned lineno, const std::string &msg) = 0;
+  size_t records = 0; // made, for Options::profile
+};
+
+struct Icf::Direct : Icf::Sink {
+  Icf &icf;
+  const std::string &fname;
+  Defined &defined;
+  Set last;
+  Direct(Icf &i, const std::string &f, Defined &d)
+      : icf(i), fname(f), defined(d) {}
+  const Set &symbols(const std::string &groupdesc) {
+    last = icf.setByName(groupdesc, fname);
+    return last;
+  }
+  void record(const IcfKey &k, const std::string &sym,
+              const std::string &value, Origin env) {
+    icf.record(k, sym, value, env);
+  }
+  void section(const std::string &sections) {
+    icf.icfSections_.emplace(sections);
+  }
+  void present(const IcfKey &k) { icf.present(k); }
+  void define(const IcfKey &k, const std::string &groupdesc, unsigned lineno,
+              const sophoi::LexLine &lex) {
+    auto dup = defined.emplace(make_pair(k, groupdesc), lineno);
+    if (not dup.second) {
+      icf.fail(dupMsg(k, groupdesc, dup.first->second,
+                      fname + ':' + std::to_string(lineno) + ": " +
+                          lex.line()));
+    }
+  }
+  void fail(unsigned, const std::string &msg) { icf.fail(msg); }
+};
+
+// what a chunk of lines adds to the tree, built on a thread of its own;
+// groupdescs are resolved before, everything else is kept to the chunk
+struct Icf::Partial : Icf::Sink {
+  const Groups &resolved;
+  bool keepHistory;
+  Store store;
+  History history;
+  Set sections;
+  std::vector<std::pair<unsigned, std::string>> errors; // at lineno
+  struct Line {
+    unsigned lineno;
+    const char *raw; // to report a dup once the first definition is known
+    uint32_t len;
+  };
+  // (key, groupdesc) -> first line in the chunk, and every other line
+  std::map<std::pair<IcfKey, std::string>, Line> defined;
+  std::vector<std::pair<const std::pair<IcfKey, std::string> *, Line>> dups;
+  const std::string &fname;
+  Partial(const Groups &r, bool h, const std::string &f)
+      : resolved(r), keepHistory(h), fname(f) {}
+  const Set &symbols(const std::string &groupdesc) {
+    static const Set none;
+    auto itr = resolved.find(groupdesc);
+    return itr == resolved.end() ? none : itr->second;
+  }
+  void record(const IcfKey &k, const std::string &sym,
+              const std::string &value, Origin env) {
+    fold(store, keepHistory ? &history : NULL, k, sym, value, env);
+  }
+  void section(const std::string &s) { sections.emplace(s); }
+  void present(const IcfKey &k) { store[k]; }
+  void define(const IcfKey &k, const std::string &groupdesc, unsigned lineno,
+              const sophoi::LexLine &lex) {
+    Line l = {lineno, lex.raw, lex.rawLen};
+    auto dup = defined.emplace(make_pair(k, groupdesc), l);
+    if (not dup.second) {
+      dups.push_back(make_pair(&dup.first->first, l));
+    }
+  }
+  void fail(unsigned lineno, const std::string &msg) {
+    errors.push_back(make_pair(lineno, msg));
+  }
+  void dup(const std::pair<IcfKey, std::string> &kg, const Line &l,
+           unsigned first) {
+    errors.push_back(make_pair(
+        l.lineno, dupMsg(kg.first, kg.second, first,
+                         fname + ':' + std::to_string(l.lineno) + ": " +
+                             string(l.raw, l.len))));
+  }
+};
 
 Icf::Icf(const char *fn, const std::set<std::string> &ancestors,
-         std::shared_ptr<PathFinder> pf) {
+         std::shared_ptr<PathFinder> pf, std::shared_ptr<Options> opts) {
+  exprs_.reset(new groupexpr::Cache());
+  if (not opts.get()) {
+    opts_.reset(new Options());
+  } else {
+    opts_ = opts;
+  }
   if (not pf.get()) {
     pf_.reset(new PathFinder(fn));
+    if (not pf_->error().empty()) {
+      fail(pf_->error());
+      return;
+    }
   } else {
     pf_ = pf;
   }
@@ -86,50 +344,117 @@ Icf::Icf(const char *fn, const std::set<std::string> &ancestors,
   std::string fname = pf_->locate(fn);
   auto fitr = ancestors.find(string(fname));
   if (fitr != ancestors.end()) {
-    std::cerr << " --- bad icf with circular include: " << fname << std::endl;
-    exit(-1);
+    fail(" --- bad icf with circular include: " + fname);
+    return;
   }
   if (ancestors.size() > 100) {
     std::cerr << " --- suspicious icf include depth: " << ancestors.size()
               << std::endl;
   }
 
-  ifstream infile(fname);
-  // XXX look for file in other paths defined in env{ICFPATH}; ancestors logic
-  // may need change to use canonical path; also update fname to be more exact?
-  if (infile.fail()) {
-    std::cerr << " --- cannot read file: " << fname << std::endl;
-    exit(-1);
+  std::string buffered; // read while the parent was parsed
+  std::unique_ptr<sophoi::MappedFile> mapped;
+  const char *data = NULL;
+  size_t size = 0;
+  std::string member;
+  auto arc = pf_->archiveOf(fname, member);
+  if (arc) { // parsed in place
+    if (not arc->find(member, data, size)) {
+      fail(" --- cannot read file: " + fname);
+      return;
+    }
+    sources_[arc->path()] = arc->mtime();
+  } else if (opts_->prefetch and opts_->prefetch->take(fname, buffered)) {
+    data = buffered.data();
+    size = buffered.size();
+  } else {
+    mapped.reset(new sophoi::MappedFile(fname));
+    // XXX look for file in other paths defined in env{ICFPATH}; ancestors
+    // logic may need change to use canonical path; also update fname?
+    if (not mapped->ok()) {
+      fail(" --- cannot read file: " + fname);
+      return;
+    }
+    data = mapped->data();
+    size = mapped->size();
+  }
+  ICF_TRACE3(file_open, fname.c_str(), size, ancestors.size());
+  if (opts_->profile) {
+    opts_->profile->enter(fname);
+  }
+  if (opts_->prefetch and not arc) {
+    opts_->prefetch->scan(fname, data, size, *pf_);
+  }
+  struct stat st;
+  if (not arc and stat(fname.c_str(), &st) == 0) {
+    sources_[fname] = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
   }
 
   unsigned lineno(0);
+  Defined defined;
+  Direct direct(*this, fname, defined);
+  // with Options::parallelParse, body lines outside groupdefs are gathered
+  // into chunks until a directive, which may change groups, comes; what they
+  // name is resolved here first, in order, as conjunctions define groups
+  Chunks chunks;
+  const char *runEnd = NULL;
+  size_t chunked = 0; // records made by chunks
+  std::vector<std::string> runDescs;
+  Set runSeen;
 
-  std::string ingroupdef, line;
-  while (getline(infile, line)) {
+  std::string ingroupdef;
+  // lines are classified, trimmed and split in one pass, same as
+  // detail::trim(line, true) then sophoi::split() would do
+  sophoi::LineLexer lexer(data, size);
+  sophoi::LexLine lex;
+  while (lexer.next(lex)) {
     lineno++;
-    string trimline = detail::trim(line, true);
-    if (trimline.empty()) {
+    if (lex.kind == sophoi::LexLine::BLANK) {
+      continue;
+    }
+    if (opts_->parallelParse and lex.kind == sophoi::LexLine::BODY and
+        ingroupdef.empty()) {
+      if (chunks.empty() or
+          size_t(lex.raw - chunks.back().first) >= PARSE_CHUNK) {
+        chunks.push_back(make_pair(lex.raw, lineno));
+      }
+      runEnd = lex.raw + lex.rawLen;
+      if (lex.fields.size() >= 3) {
+        auto groupdesc = lex.field(1);
+        if (runSeen.find(groupdesc) == runSeen.end() and expands(lex)) {
+          runSeen.insert(groupdesc);
+          runDescs.push_back(groupdesc);
+        }
+      }
       continue;
     }
-    //    std::cout << "---- on #" << lineno << ": " << trimline << std::endl;
+    if (not chunks.empty()) {
+      chunked += parseChunks(chunks, runEnd, runDescs, fname, defined);
+      chunks.clear();
+      runDescs.clear();
+      runSeen.clear();
+    }
+    auto where = [&]() {
+      return fname + ':' + std::to_string(lineno) + ": " + lex.line();
+    };
 
-    if (trimline[0] == '#' and trimline[1] == 'i') { // including a .icf file
+    if (lex.kind == sophoi::LexLine::INCLUDE) { // including a .icf file
+      string trimline = lex.text();
       if (not ingroupdef.empty()) {
-        std::cerr << "-- unexpected #include inside groupdef in " << fname
-                  << ':' << lineno << ": " << line << std::endl;
-        exit(-1);
+        fail("-- unexpected #include inside groupdef in " + where());
+        continue;
       }
       // start from the char right after first ' ' or '\t'
       string inc = trimline.substr(sizeof(detail::INCLUDE));
       inc = detail::trim(inc);
       if (inc.empty()) {
-        std::cerr << "-- empty include in " << fname << ':' << lineno << ": "
-                  << line << std::endl;
-        exit(-1);
+        fail("-- empty include in " + where());
+        continue;
       }
       std::set<std::string> ans = ancestors;
       ans.insert(string(fname));
-      Icf imported(inc.c_str(), ans, pf_);
+      ICF_TRACE3(include, fname.c_str(), lineno, inc.c_str());
+      Icf imported(inc.c_str(), ans, pf_, opts_);
       //      auto itr = imported.store_.begin();
       //      for (; itr != imported.store_.end(); ++itr) {
       //        store_[itr->first] = itr->second; // XXX this needs update,
@@ -138,87 +463,269 @@ Icf::Icf(const char *fn, const std::set<std::string> &ancestors,
       for (auto &kv : imported.groups_) {
         groups_[kv.first] = kv.second;
       }
+      conjunctions_.insert(begin(imported.conjunctions_),
+                           end(imported.conjunctions_));
+      groupsChanged();
+      for (auto &ks : imported.history_) { // but for the final values,
+        for (auto &sv : ks.second) {       // which mergeStore records
+          auto &hist = history_[ks.first][sv.first];
+          hist.insert(end(hist), begin(sv.second), end(sv.second) - 1);
+        }
+      }
       mergeStore(imported.store_); // do after groups_ updated as it can be
                                    // affected by groups_
       for (auto &i : imported.icfSections_) {
         icfSections_.insert(i);
       }
-    } else if (trimline[0] == '#' and trimline[1] == 'g') { // start groupdef
+      sources_.insert(begin(imported.sources_), end(imported.sources_));
+      ICF_TRACE2(include_done, fname.c_str(), lineno); // merged
+    } else if (lex.kind == sophoi::LexLine::GROUPDEF) { // start groupdef
+      string trimline = lex.text();
       if (not ingroupdef.empty()) {
-        std::cerr << "-- unexpected #groupdef (with def of group '"
-                  << ingroupdef << "' in " << fname << ':' << lineno << ": "
-                  << line << std::endl;
-        exit(-1);
+        fail("-- unexpected #groupdef (with def of group '" + ingroupdef +
+             "' in " + where());
+        continue;
       }
       // start from the char right after first ' ' or '\t'
       string inc = trimline.substr(sizeof(detail::GROUPDEF));
       ingroupdef = detail::trim(inc);
       auto parts = sophoi::split(ingroupdef);
       if (parts.size() > 1) {
-        std::cerr << "-- #groupdef with more than 1 words in " << fname << ':'
-                  << lineno << ": " << line << std::endl;
-        exit(-1);
+        fail("-- #groupdef with more than 1 words in " + where());
+        continue;
       }
-    } else if (trimline[0] == '#' and trimline[1] == 'e') { // end groupdef
+    } else if (lex.kind == sophoi::LexLine::ENDGROUPDEF) { // end groupdef
       if (ingroupdef.empty()) {
-        std::cerr << "-- unexpected #endgroupdef in " << fname << ':' << lineno
-                  << ": " << line << std::endl;
-        exit(-1);
+        fail("-- unexpected #endgroupdef in " + where());
+        continue;
       }
       ingroupdef = "";
+      groupsChanged();
+    } else if (lex.kind == sophoi::LexLine::GROUPEXPR) {
+      if (not ingroupdef.empty()) {
+        fail("-- unexpected #groupexpr inside groupdef in " + where());
+        continue;
+      }
+      auto text = lex.text();
+      groupExpr(detail::trim(text.substr(std::min(text.size(),
+                                                  sizeof(detail::GROUPEXPR)))),
+                where());
+    } else if (lex.kind == sophoi::LexLine::GROUPFILE) {
+      if (not ingroupdef.empty()) {
+        fail("-- unexpected #groupfile inside groupdef in " + where());
+        continue;
+      }
+      auto text = lex.text();
+      groupFile(detail::trim(text.substr(std::min(text.size(),
+                                                  sizeof(detail::GROUPFILE)))),
+                where());
     } else if (not ingroupdef.empty()) {
-      auto parts = sophoi::split(trimline);
-      if (parts.size() > 1) {
-        std::cerr << "-- #groupdef '" << ingroupdef
-                  << "' with more than 1 elements in " << fname << ':' << lineno
-                  << ": " << line << std::endl;
-        exit(-1);
+      if (lex.fields.size() > 1) {
+        fail("-- #groupdef '" + ingroupdef +
+             "' with more than 1 elements in " + where());
+        continue;
+      }
+      auto &members = groups_[ingroupdef];
+      auto sym = lex.text();
+      if (opts_->ignored.find(sym) != opts_->ignored.end()) {
+        continue;
       }
-      if (not groups_[ingroupdef].emplace(trimline).second) {
-        std::cerr << "-- #groupdef '" << ingroupdef
-                  << "' with duplicate element in " << fname << ':' << lineno
-                  << ": " << line << std::endl;
+      if (not members.empty() and *members.rbegin() < sym) { // sorted so far
+        members.emplace_hint(members.end(), std::move(sym));
+      } else if (not members.emplace(std::move(sym)).second) {
+        warn("-- #groupdef '" + ingroupdef + "' with duplicate element in " +
+             where());
       }
     } else {
-      auto parts = sophoi::split(trimline);
-      if (parts.size() < 3) {
-        std::cerr << "-- bad icf line with less than 3 parts in " << fname
-                  << ':' << lineno << ": " << line << std::endl;
-        exit(-1);
+      parseBody(lex, lineno, fname, direct);
+    }
+  }
+  if (not chunks.empty()) {
+    chunked += parseChunks(chunks, runEnd, runDescs, fname, defined);
+  }
+  ICF_TRACE2(file_close, fname.c_str(), lineno);
+  if (opts_->prefetch) {
+    opts_->prefetch->parsed(fname);
+  }
+  if (opts_->profile) {
+    opts_->profile->leave(lineno, direct.records + chunked);
+  }
+  if (opts_->validateOnly) {
+    if (not ingroupdef.empty()) {
+      fail("-- #groupdef '" + ingroupdef + "' not ended in " + fname);
+    }
+    return; // derived groups are only needed for output and diff
+  }
+
+  trickleDown();
+  defaultGroup(); // includes using DEFAULT need it now, the rest can wait
+}
+
+// whether parsing the line expands its groupdesc, or defines groups with it
+bool Icf::expands(const sophoi::LexLine &lex) const {
+  auto groupdesc = lex.field(1);
+  if (groupdesc.find_first_of("^+()") != string::npos) {
+    return true;
+  }
+  if (opts_->validateOnly or not opts_->keepHeader(lex.field(0))) {
+    return false;
+  }
+  for (size_t i = 2; i < lex.fields.size(); ++i) {
+    auto &param = lex.fields[i];
+    if (not(param.eq == 0 or param.eq == param.len or
+            param.eq + 1 == param.len) and
+        opts_->keepKey(string(lex.raw + param.off, param.eq))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// a line of "sections groupdesc k1=v1 k2=v2 ..."
+void Icf::parseBody(const sophoi::LexLine &lex, unsigned lineno,
+                    const std::string &fname, Sink &sink) const {
+  auto where = [&]() {
+    return fname + ':' + std::to_string(lineno) + ": " + lex.line();
+  };
+  if (lex.fields.size() < 3) {
+    sink.fail(lineno, "-- bad icf line with less than 3 parts in " + where());
+    return;
+  }
+  auto sections = lex.field(0);
+  // groupdesc may not be #groupdefed, but rather be either symbol (list)
+  // or #groupdef combined
+  auto groupdesc = lex.field(1);
+  bool keep = opts_->keepHeader(sections) and not opts_->validateOnly;
+  const Set *symbols = NULL; // expanded on the first kv pair kept
+  Set single;
+  Origin env = NOORIGIN;
+  for (size_t i = 2; i < lex.fields.size(); ++i) {
+    auto &param = lex.fields[i];
+    const char *p = lex.raw + param.off;
+    if (param.eq == 0 or param.eq == param.len or param.eq + 1 == param.len) {
+      sink.fail(lineno, "-- bad kv pair definition '" + lex.field(i) +
+                            "' in " + where());
+      continue;
+    }
+    sink.section(sections);
+    IcfKey k = make_pair(sections, string(p, param.eq));
+    if (opts_->validateOnly) {
+      sink.define(k, groupdesc, lineno, lex);
+    }
+    if (not keep or not opts_->keepKey(k.second)) {
+      continue;
+    }
+    if (not symbols) {
+      symbols = &sink.symbols(groupdesc);
+      if (symbols->empty()) {
+        single.insert(groupdesc);
+        symbols = &single;
+      } // single symbol XXX extend to comma (,) separated symbols?
+      env = origin(fname, lineno, groupdesc);
+    }
+    auto v = string(p + param.eq + 1, param.len - param.eq - 1);
+    bool selectedOut = false;
+    for (auto &symbol : *symbols) {
+      if (opts_->keepSymbol(symbol)) {
+        sink.record(k, symbol, v, env);
+        sink.records++;
+      } else if (not selectedOut) {
+        selectedOut = opts_->ignored.find(symbol) == opts_->ignored.end();
       }
-      auto sections = parts[0];
-      // groupdesc may not be #groupdefed, but rather be either symbol (list)
-      // or #groupdef combined
-      auto groupdesc = parts[1];
-      parts.erase(parts.begin(), parts.begin() + 2);
-      for (auto &param : parts) {
-        auto eqpos = param.find_first_of("=");
-        if (eqpos == 0 or eqpos == string::npos
-            or eqpos + 1 == param.length()) {
-          std::cerr << "-- bad kv pair definition '" << param << "' in "
-                    << fname << ':' << lineno << ": " << line << std::endl;
-          exit(-1);
+    }
+    if (selectedOut) {
+      sink.present(k);
+    }
+  }
+  if (not symbols and groupdesc.find_first_of("^+()") != string::npos) {
+    sink.symbols(groupdesc); // conjunction defines groups as it goes, and
+                             // bad expressions are caught
+  }
+}
+
+// parse chunks of body lines, the last ending at runEnd, on all cores, and merge
+// their partial stores in chunk order
+size_t Icf::parseChunks(const Chunks &chunks, const char *runEnd,
+                        const std::vector<std::string> &groupdescs,
+                        const std::string &fname, Defined &defined) {
+  Groups resolved;
+  for (auto &g : groupdescs) {
+    resolved[g] = setByName(g, fname);
+  }
+  std::vector<std::unique_ptr<Partial>> parts(chunks.size());
+  std::vector<std::pair<unsigned, std::string>> errors;
+  size_t records = 0;
+  sophoi::parallelFor(
+      chunks.size(),
+      [&](size_t c) {
+        parts[c].reset(new Partial(resolved, opts_->history, fname));
+        auto &part = *parts[c];
+        const char *b = chunks[c].first;
+        const char *e = c + 1 < chunks.size() ? chunks[c + 1].first : runEnd;
+        ICF_TRACE3(parse_chunk, fname.c_str(), chunks[c].second, e - b);
+        sophoi::LineLexer lexer(b, e - b);
+        sophoi::LexLine lex;
+        for (unsigned lineno = chunks[c].second; lexer.next(lex); ++lineno) {
+          if (lex.kind == sophoi::LexLine::BODY) {
+            parseBody(lex, lineno, fname, part);
+          }
         }
-        IcfKey k = make_pair(sections, param.substr(0, eqpos));
-        icfSections_.emplace(sections);
-        // XXX bad: need to keep original group name here too to help find dups
-        // if (groups_.find(k) != groups.end()) { std::cerr << "-- dup kv pair
-        // definition '" << sections << ':' << kv.first << "' in " << fname <<
-        // ':' << lineno << ": " << line << std::endl; }
-        auto symbols = setByName(groupdesc, fname);
-        if (symbols.empty()) {
-          symbols.insert(groupdesc);
-        } // single symbol XXX extend to comma (,) separated symbols?
-        auto v = param.substr(eqpos+1);
-        for (auto symbol : symbols) {
-          record(k, symbol, v, groupdesc);
+        ICF_TRACE2(parse_chunk_done, fname.c_str(), chunks[c].second);
+      },
+      [&](size_t c) {
+        auto &part = *parts[c];
+        for (auto &d : part.defined) { // dups across chunks
+          auto first = defined.emplace(d.first, d.second.lineno);
+          if (not first.second) {
+            part.dup(d.first, d.second, first.first->second);
+          }
         }
-      }
-    }
+        for (auto &d : part.dups) {
+          part.dup(*d.first, d.second, defined[*d.first]);
+        }
+        std::stable_sort(begin(part.errors), end(part.errors),
+                         [](const std::pair<unsigned, std::string> &a,
+                            const std::pair<unsigned, std::string> &b) {
+                           return a.first < b.first;
+                         });
+        errors.insert(end(errors), begin(part.errors), end(part.errors));
+        for (auto &ks : part.history) { // as for an include
+          for (auto &sv : ks.second) {
+            auto &hist = history_[ks.first][sv.first];
+            hist.insert(end(hist), begin(sv.second), end(sv.second) - 1);
+          }
+        }
+        mergeStore(part.store);
+        icfSections_.insert(begin(part.sections), end(part.sections));
+        records += part.records;
+        parts[c].reset();
+      });
+  for (auto &e : errors) { // after the threads are done, as the first exits
+    fail(e.second);
   }
+  return records;
+}
 
-  trickleDown();
+// derived groups and section sets are only needed for output and diff, so
+// they are made once, on the root of an include tree, when first asked for
+void Icf::ensureDerived() const {
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
+  if (derived_) {
+    return;
+  }
+  derived_ = true;
+  conjunctionVariants();
   combineSets();
+  sectionSets();
+}
+
+// for sub-key lookups in diff, which need no derived groups
+void Icf::sectionSets() const {
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
+  if (sectionSetsMade_) {
+    return;
+  }
+  sectionSetsMade_ = true;
   for (auto &sections : icfSections_) { // header:p1,p3,p2 becomes header => {
                                         // p1,p3,p2 : [ p1, p2, p3 ] }
     auto hp = sophoi::split(sections, ":");
@@ -229,8 +736,229 @@ Icf::Icf(const char *fn, const std::set<std::string> &ancestors,
     std::sort(begin(ps), end(ps));
     icfSets_[hp[0]][hp[1]] = ps;
   }
+}
+
+// whether an expression names a group at all, or is a symbol like BRK-B
+bool Icf::exprHasGroup(const std::string &expr) const {
+  std::string err;
+  auto n = groupexpr::parse(expr, groups_, err);
+  return n and groupexpr::hasGroup(*n, groups_);
+}
+
+// the set of a group expression, or of an item
+Icf::Set Icf::exprSet(const std::string &expr, std::string &err) {
+  auto itr = groups_.find(expr);
+  if (itr != groups_.end()) {
+    return itr->second;
+  }
+  auto set = exprs_->eval(expr, groups_, err);
+  if (not err.empty() and not groupexpr::namesGroup(expr, groups_)) {
+    err.clear();
+  }
+  return set ? *set : err.empty() ? Set{expr} : Set();
+}
 
-  grpNamCombs_ = getGrpNamCombs();
+// #groupfile NAME path adds the symbols of a list, see symlist.hpp, to group
+// NAME as #groupdef does, duplicates reported alike; each is put at the end
+// of the set, so a sorted list, as a binary one always is, loads in one pass,
+// and any other order still loads, at a lookup per symbol
+void Icf::groupFile(const std::string &text, const std::string &where) {
+  auto parts = sophoi::split(text);
+  if (parts.size() != 2) {
+    fail("-- #groupfile without NAME and path in " + where);
+    return;
+  }
+  auto fname = pf_->locate(parts[1]);
+  std::unique_ptr<sophoi::MappedFile> mapped;
+  const char *data = NULL;
+  size_t size = 0;
+  std::string member;
+  auto arc = pf_->archiveOf(fname, member);
+  if (arc) {
+    if (not arc->find(member, data, size)) {
+      fail("-- cannot read #groupfile " + fname + " in " + where);
+      return;
+    }
+  } else {
+    mapped.reset(new sophoi::MappedFile(fname));
+    struct stat st;
+    if (not mapped->ok() or stat(fname.c_str(), &st) != 0) {
+      fail("-- cannot read #groupfile " + fname + " in " + where);
+      return;
+    }
+    data = mapped->data();
+    size = mapped->size();
+    sources_[fname] = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+  auto duplicate = [&](const std::string &sym) {
+    warn("-- #groupfile '" + parts[0] + "' with duplicate element " + sym +
+         " of " + fname + " in " + where);
+  };
+  Set members;
+  std::string err;
+  bool ok = icfsyms::scan(data, size, [&](const char *s, size_t len) {
+    std::string sym(s, len);
+    if (opts_->ignored.find(sym) != opts_->ignored.end()) {
+      return;
+    }
+    if (members.empty() or *members.rbegin() < sym) { // sorted so far
+      members.emplace_hint(members.end(), std::move(sym));
+    } else if (not members.insert(sym).second) {
+      duplicate(sym);
+    }
+  }, err);
+  if (not ok) {
+    fail("-- bad #groupfile " + fname + " (" + err + ") in " + where);
+    return;
+  }
+  auto &grp = groups_[parts[0]];
+  if (grp.empty()) {
+    grp = std::move(members);
+  } else {
+    for (auto &m : members) {
+      if (not grp.insert(m).second) {
+        duplicate(m);
+      }
+    }
+  }
+  groupsChanged();
+}
+
+// memoized expressions are stale once a group is (re)defined
+void Icf::groupsChanged() {
+  exprs_->clear();
+}
+
+// #groupexpr NAME = EXPR defines NAME, unless NAME is a group already;
+// EXPR < EXPR, EXPR > EXPR (or a << A for an item) and EXPR = EXPR with
+// groups defined on both sides, NAME = EXPR of a defined NAME too, are checked
+void Icf::groupExpr(const std::string &text, const std::string &where) {
+  auto rel = text.find_first_of("<>=");
+  if (rel == string::npos) {
+    fail("-- #groupexpr without =, < or > in " + where);
+    return;
+  }
+  char op = text[rel];
+  auto lhs = detail::trim(text.substr(0, rel));
+  auto rhsAt = rel + 1;
+  while (rhsAt < text.size() and text[rhsAt] == op) { // a << A, A == B
+    rhsAt++;
+  }
+  auto rhs = detail::trim(text.substr(rhsAt));
+  std::string err;
+  auto r = exprSet(rhs, err);
+  if (lhs.empty() or rhs.empty() or not err.empty()) {
+    fail("-- bad #groupexpr" + (err.empty() ? "" : " (" + err + ")") +
+         " in " + where);
+    return;
+  }
+  if (op == '=' and lhs.find_first_of(" \t+-^()") == string::npos and
+      groups_.find(lhs) == groups_.end()) {
+    groups_[lhs] = r;
+    groupsChanged();
+    return;
+  }
+  auto l = exprSet(lhs, err);
+  if (not err.empty()) {
+    fail("-- bad #groupexpr (" + err + ") in " + where);
+    return;
+  }
+  Set extra; // what breaks the relation
+  if (op != '>') {
+    std::set_difference(begin(l), end(l), begin(r), end(r),
+                        inserter(extra, begin(extra)));
+  }
+  if (op != '<') {
+    std::set_difference(begin(r), end(r), begin(l), end(l),
+                        inserter(extra, begin(extra)));
+  }
+  if (not extra.empty()) {
+    fail("-- #groupexpr relation does not hold for " +
+         sophoi::join(",", begin(extra), end(extra)) + " in " + where);
+  }
+}
+
+// report a bad icf: collected under validate mode, fatal otherwise
+void Icf::fail(const std::string &msg) const {
+  if (not opts_->collectErrors) {
+    std::cerr << msg << std::endl;
+    exit(-1);
+  }
+  opts_->errors.push_back(msg);
+}
+
+// report a doubtful icf: collected under validate mode, printed otherwise
+void Icf::warn(const std::string &msg) const {
+  if (opts_->collectErrors) {
+    opts_->errors.push_back(msg);
+  } else {
+    std::cerr << msg << std::endl;
+  }
+}
+
+Icf::Options::Options() {
+  auto items = [](const char *env) {
+    const char *v = getenv(env);
+    return v ? sophoi::split(v, ",") : std::vector<std::string>();
+  };
+  for (auto &i : items("IGNORED_ITEMS")) {
+    ignored.insert(i);
+  }
+  for (auto &h : items("SELECT_SECTIONS")) {
+    if (h.back() == '*') {
+      h.pop_back();
+    }
+    if (not h.empty() and h.back() == ':') {
+      h.pop_back();
+      exactHeaders.insert(h);
+    } else {
+      headers.push_back(h);
+    }
+  }
+  for (auto &k : items("SELECT_KEYS")) {
+    keys.insert(k);
+  }
+  for (auto &s : items("SELECT_SYMBOLS")) {
+    symbols.insert(s);
+  }
+  const char *h = getenv("VALUE_HISTORY");
+  history = h and *h and std::string(h) != "0";
+  const char *pp = getenv("PARALLEL_PARSE");
+  parallelParse = pp and *pp and std::string(pp) != "0";
+  const char *pf = getenv("PREFETCH");
+  if (pf and *pf and std::string(pf) != "0") {
+    prefetch.reset(new icfio::Prefetcher());
+  }
+}
+
+// selection is by whole header, as values of header:p1,p2 fall back to those
+// of its sub-sections (header:p1, header) in diff
+bool Icf::Options::keepHeader(const std::string &sections) const {
+  auto header = sections.substr(0, sections.find(':'));
+  if (not headers.empty() or not exactHeaders.empty()) {
+    bool selected = exactHeaders.find(header) != exactHeaders.end();
+    for (auto h = begin(headers); not selected and h != end(headers); ++h) {
+      selected = header.compare(0, h->size(), *h) == 0;
+    }
+    if (not selected) {
+      return false;
+    }
+  }
+  return shards < 2 or shardBySymbol or
+         sophoi::fnv1a(header) % shards == shard;
+}
+
+bool Icf::Options::keepKey(const std::string &key) const {
+  return keys.empty() or keys.find(key) != keys.end();
+}
+
+bool Icf::Options::keepSymbol(const std::string &sym) const {
+  if (ignored.find(sym) != ignored.end() or
+      (not symbols.empty() and symbols.find(sym) == symbols.end())) {
+    return false;
+  }
+  return shards < 2 or not shardBySymbol or
+         sophoi::fnv1a(sym) % shards == shard;
 }
 
 Icf::Set Icf::setByName(const std::string &name, const std::string &fname) {
@@ -238,20 +966,46 @@ Icf::Set Icf::setByName(const std::string &name, const std::string &fname) {
   if (itr != groups_.end()) {
     return itr->second;
   } else {
-    if (name.find('^') != string::npos) {
-      auto parts = sophoi::split(name, "^");
-      if (parts.size() != 2) {
-        cerr << "-- bad group conjunction specified: '" << name << "' in "
-             << fname << endl;
-        exit(-1);
+    auto op = name.find_first_of("+-");
+    if (name.size() > 2 and name[0] == '(' and name.back() == ')' and
+        op != string::npos) { // (A+B) etc. used before made by ensureDerived
+      auto l = name.substr(1, op - 1), r = name.substr(op + 1);
+      r.pop_back();
+      for (auto &conj : {l + '^' + r, r + '^' + l}) {
+        if (conjunctions_.find(conj) != conjunctions_.end()) {
+          conjunctionVariants(conj);
+        }
+      }
+      itr = groups_.find(name);
+      if (itr != groups_.end()) {
+        return itr->second;
+      }
+    }
+    auto parts = sophoi::split(name, "^");
+    bool conjunction = parts.size() == 2 and
+                       name.find_first_of("+()") == string::npos;
+    for (auto &p : parts) { // G1-G2^G3 is not one
+      conjunction = conjunction and
+                    (groups_.find(p) != groups_.end() or
+                     p.find('-') == string::npos or not exprHasGroup(p));
+    }
+    if (not conjunction and name.find_first_of("+-^()") != string::npos) {
+      std::string err;
+      auto set = exprs_->eval(name, groups_, err);
+      if (not err.empty() and groupexpr::namesGroup(name, groups_)) {
+        fail("-- bad group expression '" + name + "' (" + err + ") in " + fname);
       }
+      // with no group in it, a symbol like BRK-B, ES+ or X(1)
+      return set ? *set : Set();
+    }
+    if (name.find('^') != string::npos) {
       // group^item may mean single item or empty group
       auto l = groups_.find(parts[0]);
       auto r = groups_.find(parts[1]);
       if (l == groups_.end() and r == groups_.end()) {
-        cerr << "-- invalid group in conjunction: either '" << parts[0]
-             << "' or '" << parts[1] << "' in " << fname << endl;
-        exit(-1);
+        fail("-- invalid group in conjunction: either '" + parts[0] +
+             "' or '" + parts[1] + "' in " + fname);
+        return Set();
       }
       Groups mock_l = {{ parts[0], { parts[0] } }};
       Groups mock_r = {{ parts[1], { parts[1] } }};
@@ -267,29 +1021,9 @@ Icf::Set Icf::setByName(const std::string &name, const std::string &fname) {
                             inserter(conj, begin(conj)));
       if (not conj.empty() and conj != r->second and conj != l->second) {
         groups_[name] = conj;
+        groupsChanged();
       }
-//      if (not conj.empty() and conj != r->second and conj != l->second) {
-//        groups_["("+parts[0]+"*"+parts[1]+")"] = conj;
-//      }
-      // do not change the () format as it's used later (defined op-ed set)
-      Set disj;
-      std::set_union(begin(l->second), end(l->second), begin(r->second),
-                     end(r->second), inserter(disj, begin(disj)));
-      if (disj != l->second and disj != l->second) {
-        groups_["("+parts[0]+"+"+parts[1]+")"] = disj;
-      }
-      Set diff;
-      std::set_difference(begin(l->second), end(l->second), begin(r->second),
-                          end(r->second), inserter(diff, begin(diff)));
-      if (not diff.empty() and diff != l->second) {
-        groups_["("+parts[0]+"-"+parts[1]+")"] = diff;
-      }
-      diff.clear();
-      std::set_difference(begin(r->second), end(r->second), begin(l->second),
-                          end(l->second), inserter(diff, begin(diff)));
-      if (not diff.empty() and diff != r->second) {
-        groups_["("+parts[1]+"-"+parts[0]+")"] = diff;
-      }
+      conjunctions_.insert(name); // (A+B), (A-B), (B-A) made by ensureDerived
       return conj;
     }
     return Set();
@@ -350,8 +1084,7 @@ std::vector<Icf::IcfKey> Icf::subkeys(IcfKey k, const SectionSets &aset) const {
   return ret;
 }
 
-// http://stackoverflow.com/questions/16182958/how-to-compare-two-stdset
-void Icf::combineSets() {
+void Icf::defaultGroup() {
   Set dftGrp;
   char *dftStr = getenv("DEFAULT");
   if (dftStr) {
@@ -372,8 +1105,70 @@ void Icf::combineSets() {
   }
 // XXX  cout << ">>>>>> DEFAULT has " << dftGrp.size() << " items" << endl; 
   if (not dftGrp.empty()) {
+    if (not dftStr) { // items of group^item make it in with (group+item)
+      for (auto &name : conjunctions_) {
+        for (auto &part : sophoi::split(name, "^")) {
+          if (groups_.find(part) == groups_.end()) {
+            dftGrp.insert(part);
+          }
+        }
+      }
+    }
     groups_["DEFAULT"] = dftGrp;
   }
+}
+
+// the (A+B), (A-B) and (B-A) of every A^B seen, with A or B possibly an item
+void Icf::conjunctionVariants() const {
+  for (auto &name : conjunctions_) {
+    conjunctionVariants(name);
+  }
+}
+
+void Icf::conjunctionVariants(const std::string &name) const {
+  {
+    auto parts = sophoi::split(name, "^");
+    auto l = groups_.find(parts[0]);
+    auto r = groups_.find(parts[1]);
+    Groups mock_l = {{ parts[0], { parts[0] } }};
+    Groups mock_r = {{ parts[1], { parts[1] } }};
+    if (l == groups_.end()) {
+      l = mock_l.find(parts[0]);
+    }
+    if (r == groups_.end()) {
+      r = mock_r.find(parts[1]);
+    }
+    // do not change the () format as it's used later (defined op-ed set)
+    Set disj;
+    std::set_union(begin(l->second), end(l->second), begin(r->second),
+                   end(r->second), inserter(disj, begin(disj)));
+    Set ldiff, rdiff;
+    std::set_difference(begin(l->second), end(l->second), begin(r->second),
+                        end(r->second), inserter(ldiff, begin(ldiff)));
+    std::set_difference(begin(r->second), end(r->second), begin(l->second),
+                        end(l->second), inserter(rdiff, begin(rdiff)));
+    bool ldistinct = not ldiff.empty() and ldiff != l->second;
+    bool rdistinct = not rdiff.empty() and rdiff != r->second;
+    if (disj != l->second) {
+      groups_["(" + parts[0] + "+" + parts[1] + ")"] = disj;
+    }
+    if (ldistinct) {
+      groups_["(" + parts[0] + "-" + parts[1] + ")"] = ldiff;
+    }
+    if (rdistinct) {
+      groups_["(" + parts[1] + "-" + parts[0] + ")"] = rdiff;
+    }
+  }
+}
+
+// http://stackoverflow.com/questions/16182958/how-to-compare-two-stdset
+void Icf::combineSets() const {
+  ICF_TRACE1(combine_start, groups_.size());
+  Set dftGrp;
+  auto dft = groups_.find("DEFAULT");
+  if (dft != groups_.end()) {
+    dftGrp = dft->second;
+  }
 
   std::map<std::string, std::set<std::string>>
   prefixes; // prefix -> group names
@@ -437,7 +1232,7 @@ void Icf::combineSets() {
     Set all;
     Set grpNames;
     for (auto &s : kv.second) {
-      auto &g = groups_[s];
+      auto &g = groups_.at(s);
       all.insert(begin(g), end(g));
       grpNames.insert(s);
     }
@@ -448,24 +1243,83 @@ void Icf::combineSets() {
       custGrpNames_.insert(kv.first + "*");
     }
   }
+  ICF_TRACE1(combine_done, extraGroups_.size());
 }
 
 void Icf::record(const IcfKey &k, std::string sym, std::string value,
-                 std::string env) {
-  auto &valueRecords = storeHelper_[k][sym];
-  bool isDefaultSetter = env == "DEFAULT";
-  if (not valueRecords.empty()) {
-    std::string val, env;
-    std::tie(val, env) = valueRecords.back();
-    if (env != "DEFAULT" and isDefaultSetter) {
-      return;
+                 Origin env) {
+  if (opts_.get() and opts_->spill.get()) {
+    opts_->spill->add(k, sym, value, env);
+    return;
+  }
+  fold(store_, opts_.get() and opts_->history ? &history_ : NULL, k,
+       std::move(sym), std::move(value), env);
+}
+
+// k with no symbol of its own yet, so diff takes it as defined
+void Icf::present(const IcfKey &k) {
+  if (opts_.get() and opts_->spill.get()) {
+    opts_->spill->addKey(k);
+    return;
+  }
+  store_[k];
+}
+
+// key -> value -> { symbol : context }, to describe symbols sharing a value
+Icf::Inverted Icf::inverted() const {
+  Inverted inv;
+  for (auto &ks : store_) {
+    auto &values = inv[ks.first];
+    for (auto &sv : ks.second) {
+      values[sv.second.first][sv.first] = sv.second.second;
     }
-    store_[k][val].erase(sym); // doesn't matter if val is same as value, we may
-                               // need to update with new context anyway
   }
-  valueRecords.push_back(make_pair(value, env));
+  return inv;
+}
+
+// every value recorded for a symbol, in order, if Options::history
+const std::vector<Icf::WithEnv> &Icf::history(const IcfKey &k,
+                                             const std::string &sym) const {
+  static const std::vector<WithEnv> none;
+  auto itr = history_.find(k);
+  if (itr == history_.end()) {
+    return none;
+  }
+  auto hs = itr->second.find(sym);
+  return hs == itr->second.end() ? none : hs->second;
+}
 
-  store_[k][value][sym] = env;
+// symbol -> value for key k, or only for sym if given
+std::map<std::string, std::string> Icf::query(const IcfKey &k,
+                                              const std::string &sym) const {
+  std::map<std::string, std::string> ret;
+  auto itr = store_.find(k);
+  if (itr == store_.end()) {
+    return ret;
+  }
+  for (auto &sv : itr->second) {
+    if (sym.empty() or sym == sv.first) {
+      ret[sv.first] = sv.second.first;
+    }
+  }
+  return ret;
+}
+
+void Icf::query_to(std::ostream &output, const IcfKey &k,
+                   const std::string &sym) const {
+  const char *prefix = getenv("DISPLAY_PREFIX");
+  if (!prefix) {
+    prefix = "";
+  }
+  for (auto &sv : query(k, sym)) {
+    output << prefix << k.first << "  " << sv.first << "  " << k.second << '='
+           << sv.second;
+    auto &hist = history(k, sv.first);
+    for (size_t i = 0; i + 1 < hist.size(); ++i) {
+      output << (i ? "," : "  # overrides ") << hist[i].first;
+    }
+    output << '\n';
+  }
 }
 
 Icf::IcfKey Icf::prek(const IcfKey &k, std::string prefix) const {
@@ -474,26 +1328,49 @@ Icf::IcfKey Icf::prek(const IcfKey &k, std::string prefix) const {
 }
 
 void Icf::mergeStore(const Store &other) {
-  // Store: key -> value  -> { symbol : context }
-  for (auto &kv : other) {
-    for (auto &vs : kv.second) {
-      for (auto &se : vs.second) {
-        record(kv.first, se.first, vs.first, se.second);
-      }
+  // Store: key -> symbol -> (value, context)
+  for (auto &ks : other) {
+    if (ks.second.empty()) {
+      present(ks.first);
+    }
+    for (auto &sv : ks.second) {
+      record(ks.first, sv.first, sv.second.first, sv.second.second);
     }
   }
 }
 
 // *predictable* nearest desc of Set: a defined name, or with minor fixup
 std::string Icf::groupDesc(const Set &s, const Set &gdesc) const {
-  for (auto &kv : groups_) { // exact match first
-    if (s == kv.second) {
-      return kv.first;
-    }
+  return nameDesc(s, describe(s, gdesc));
+}
+
+// naming in the order sets are met: a set named once keeps its name
+std::string Icf::nameDesc(const Set &s, const Desc &d) const {
+  ICF_TRACE2(group_desc, s.size(), d.how);
+  if (d.how == Desc::DEFINED) {
+    return d.name;
+  }
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
+  auto seen = seenSets_.find(s); // combined groups, seen before
+  if (seen != seenSets_.end()) {
+    return seen->second;
   }
-  for (auto &kv : seenGroups_) { // combined groups, seen before
+  if (d.how == Desc::PLAIN) {
+    return d.name;
+  }
+  auto name = d.how == Desc::NEW ? nextGrpName(s) : d.name;
+  seenGroups_[name] = s;
+  seenSets_[s] = name;
+  return name;
+}
+
+// the part of groupDesc not depending on names seen so far, safe to run
+// concurrently
+Icf::Desc Icf::describe(const Set &s, const Set &gdesc) const {
+  ICF_TRACE1(describe, s.size());
+  for (auto &kv : groups_) { // exact match first
     if (s == kv.second) {
-      return kv.first;
+      return {kv.first, Desc::DEFINED};
     }
   }
   Set gdc; // gdesc combined
@@ -522,14 +1399,11 @@ std::string Icf::groupDesc(const Set &s, const Set &gdesc) const {
   // gdesc combined is checked twice: maybe GROUP_* look better than
   // GROUP_1++GROUP_2++GROUP_3++GROUP_4
   if (!gdc.empty() && gdcNames.size() < 4 && s == gdc) {
-    auto newname = sophoi::join("++", begin(gdcNames), end(gdcNames));
-    seenGroups_[newname] = s;
-    return newname;
+    return {sophoi::join("++", begin(gdcNames), end(gdcNames)), Desc::SEEN};
   }
   for (auto &kv : extraGroups_) {
     if (s == kv.second) {
-      seenGroups_[kv.first] = s;
-      return kv.first;
+      return {kv.first, Desc::SEEN};
     }
   }
 
@@ -561,30 +1435,23 @@ std::string Icf::groupDesc(const Set &s, const Set &gdesc) const {
         for (auto &e : grExtra) {
           desc += "-" + e;
         }
-        seenGroups_[desc] = s;
-        return desc;
+        return {desc, Desc::SEEN};
       }
       if (grExtra.size() == 0 && myExtra.size() < tolerance) {
         for (auto &e : myExtra) {
           desc += "+" + e;
         }
-        seenGroups_[desc] = s;
-        return desc;
+        return {desc, Desc::SEEN};
       }
     }
   if (!gdc.empty() && gdcNames.size() >= 4 && s == gdc) {
-    auto newname = sophoi::join("++", begin(gdcNames), end(gdcNames));
-    seenGroups_[newname] = s;
-    return newname;
+    return {sophoi::join("++", begin(gdcNames), end(gdcNames)), Desc::SEEN};
   }
 
   if (s.size() < 4) {
-    return sophoi::join(",", begin(s), end(s));
+    return {sophoi::join(",", begin(s), end(s)), Desc::PLAIN};
   }
-
-  auto grpnam = nextGrpName(s.size());
-  seenGroups_[grpnam] = s;
-  return grpnam;
+  return {"", Desc::NEW};
 }
 
 std::string Icf::valSepDiff(const std::string &k, const std::string &l,
@@ -617,44 +1484,161 @@ std::string Icf::valSepDiff(const std::string &k, const std::string &l,
   return ret;
 }
 
+// written only where they change, so once set, trees diffed concurrently
+// read the separators without writes in between
 void Icf::setKVSEPS() const {
   // ex. KVSEPS=ALL,  KVSEPS=types,venues:species;
   const char *kvs = getenv("KVSEPS");
   if (!kvs) {
     return;
   }
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
   const std::string ALLOWD_SEPS(",;:.-_+=");
   std::string hey(kvs);
   if (hey.length() == 4 and hey.substr(0, 3) ==
       "ALL" and ALLOWD_SEPS.find(hey[3]) != string::npos) {
-    dftSep_ = hey.substr(3, 1);
+    if (dftSep_ != hey.substr(3, 1)) {
+      dftSep_ = hey.substr(3, 1);
+    }
     return;
   }
   size_t p = 0;
   while (p < hey.length()) {
     auto psep = hey.find_first_of(ALLOWD_SEPS, p);
     if (psep == string::npos or psep == p) {
-      cerr << "bad KVSEPS spec: " << kvs << endl;
-      exit(-1);
+      fail(std::string("-- bad KVSEPS spec: ") + kvs);
+      return;
     }
     auto k = hey.substr(p, psep-p);
     auto sep = hey[psep];
-    kvSepMap_[k] = std::string(1, sep);
+    auto ks = kvSepMap_.find(k);
+    if (ks == kvSepMap_.end() or ks->second != std::string(1, sep)) {
+      kvSepMap_[k] = std::string(1, sep);
+    }
     p = psep + 1;
   }
 }
 
-Icf Icf::diff(const Icf &newicf, bool reverse) const {
+// result of a diff, to be described by groups of this
+Icf Icf::cmpShell() const {
+  ensureDerived();
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
   Icf cmp;
-  cmp.grpNamCombs_ = getGrpNamCombs();
+  cmp.derived_ = true;
   cmp.custGrpNames_ = custGrpNames_;
+  cmp.groups_ = groups_;
+  cmp.extraGroups_ = extraGroups_;
+  cmp.starGrpNames_ = starGrpNames_;
+  return cmp;
+}
+
+// records what a diff walk finds, as the result of diff(), rolling each
+// symbol's records into its fingerprint as it goes
+struct Icf::Recorder : Icf::DiffVisitor {
+  Recorder(Icf &cmp, const Icf &mine, bool reverse)
+      : cmp(cmp), mine(mine), ind(reverse ? "+" : "-"), reverse(reverse),
+        pairs(showOrigin()) {}
+  // a pair of origins is interned only to be shown: the table never shrinks
+  bool changed(const IcfKey &k, const std::string &sym,
+               const std::string &diff, Origin o, Origin other) {
+    sign(k, sym, diff);
+    cmp.record(k, sym, diff, pairs ? origin(o, other, reverse) : o);
+    return true;
+  }
+  bool only(const IcfKey &k, const std::string &sym, const WithEnv &v) {
+    auto pk = mine.prek(k, ind);
+    sign(pk, sym, v.first);
+    cmp.record(pk, sym, v.first, v.second);
+    return true;
+  }
+  // a sum, so the same records in any order give the same fingerprint
+  void sign(const IcfKey &k, const std::string &sym, const std::string &v) {
+    cmp.fingerprints_[sym] +=
+        sophoi::fnv1a(k.first + '\x1f' + k.second + '\x1f' + v);
+  }
+  Icf &cmp;
+  const Icf &mine;
+  std::string ind;
+  bool reverse, pairs;
+};
+
+Icf Icf::diff(const Icf &newicf, bool reverse) const {
+  Icf cmp = cmpShell();
+  Recorder rec(cmp, *this, reverse);
+  diffWalk(newicf, reverse, rec);
+  if (not reverse and showMoved()) {
+    cmp.moved_ = movedSymbols(newicf);
+  }
+  // std::cout << ">>>> cmp groups: "; for (auto&kv : cmp.groups_) { std::cout
+  // << kv.first << '#' << kv.second.size() << ", "; } std::cout << std::endl;
+  return cmp;
+}
+
+namespace {
+// symbol -> sum of hashes of the defined groups it is in, DEFAULT and derived
+// (A+B) ones left out as they follow from the others
+std::unordered_map<std::string, unsigned long long>
+membership(const Icf::Groups &groups) {
+  std::unordered_map<std::string, unsigned long long> in;
+  for (auto &kv : groups) {
+    if (kv.first == "DEFAULT" or kv.first[0] == '(') {
+      continue;
+    }
+    auto h = sophoi::fnv1a(kv.first);
+    for (auto &sym : kv.second) {
+      in[sym] += h;
+    }
+  }
+  return in;
+}
+}
+
+// symbols in groups of both trees but not the same ones, those IGNORED_ITEMS
+// is for; linear in the sizes of the groups
+std::map<std::string, std::pair<Icf::Set, Icf::Set>>
+Icf::movedSymbols(const Icf &newicf) const {
+  auto was = membership(groups_), is = membership(newicf.groups_);
+  std::map<std::string, std::pair<Set, Set>> moved;
+  for (auto &sh : was) {
+    auto now = is.find(sh.first);
+    if (now != is.end() and now->second != sh.second) {
+      moved[sh.first];
+    }
+  }
+  if (moved.empty()) {
+    return moved;
+  }
+  for (int side = 0; side < 2; ++side) {
+    for (auto &kv : side ? newicf.groups_ : groups_) {
+      if (kv.first == "DEFAULT" or kv.first[0] == '(') {
+        continue;
+      }
+      for (auto &sym : kv.second) {
+        auto m = moved.find(sym);
+        if (m != moved.end()) {
+          (side ? m->second.second : m->second.first).insert(kv.first);
+        }
+      }
+    }
+  }
+  return moved;
+}
+
+bool Icf::diffWalk(const Icf &newicf, bool reverse, DiffVisitor &v) const {
+  ICF_TRACE2(diff_start, reverse, store_.size());
+  auto stop = [&]() {
+    ICF_TRACE2(diff_done, reverse, 0);
+    return false;
+  };
+  sectionSets();
+  newicf.sectionSets();
   setKVSEPS();
-  auto &old = storeHelper_;
-  auto &neu = newicf.storeHelper_;
-  std::string ind = reverse ? "+" : "-";
-  // Store: key -> value  -> { symbol : context }
-  // StoreHelper: key -> symbol -> [ value : context ]
+  auto &old = store_;
+  auto &neu = newicf.store_;
+  // Store: key -> symbol -> (value, context)
   for (auto &ks : old) {
+    ICF_TRACE3(diff_key, ks.first.first.c_str(), ks.first.second.c_str(),
+               ks.second.size());
     auto k2 = neu.find(ks.first);
     if (k2 == neu.end()) { // no such key in neu
       auto subs = subkeys(ks.first, newicf.icfSets_);
@@ -673,118 +1657,357 @@ Icf Icf::diff(const Icf &newicf, bool reverse) const {
           if (not foundSyms.insert(sv.first).second)
             std::cerr << "!! symbol found many times in diff sub-key lookup: "
                       << sv.first << std::endl;
-          auto &oldvec = sv.second;
-          auto &neuvec = s3->second;
-          assert(not oldvec.empty() and not neuvec.empty());
-          auto &oldv = oldvec.back().first;
-          auto &neuv = neuvec.back().first;
+          auto &oldv = sv.second.first;
+          auto &neuv = s3->second.first;
           if (oldv != neuv) {
             auto diff = reverse ? valSepDiff(ks.first.second, neuv, oldv, true)
                                 : valSepDiff(ks.first.second, oldv, neuv, true);
-            if (not diff.empty()) {
-              cmp.record(ks.first, sv.first, diff, oldvec.back().second);
+            if (not diff.empty() and
+                not v.changed(ks.first, sv.first, diff, sv.second.second,
+                              s3->second.second)) {
+              return stop();
             }
           }
         }
       }
       for (auto &sv : ks.second) {
-        assert(not sv.second.empty());
         auto fs = foundSyms.find(sv.first);
         if (fs != foundSyms.end())
           continue;
-        cmp.record(prek(ks.first, ind), sv.first, sv.second.back().first,
-                   sv.second.back().second);
+        if (not v.only(ks.first, sv.first, sv.second)) {
+          return stop();
+        }
       }
     } else {
       for (auto &sv : ks.second) {
         auto s2 = k2->second.find(sv.first);
         if (s2 == k2->second.end()) { // no symbol in neu with such key
-          assert(not sv.second.empty());
-          cmp.record(prek(ks.first, ind), sv.first, sv.second.back().first,
-                     sv.second.back().second);
+          if (not v.only(ks.first, sv.first, sv.second)) {
+            return stop();
+          }
         } else if (not reverse) {
-          auto &oldvec = sv.second;
-          auto &neuvec = s2->second;
-          assert(not oldvec.empty() and not neuvec.empty());
-          auto &oldv = oldvec.back().first;
-          auto &neuv = neuvec.back().first;
+          auto &oldv = sv.second.first;
+          auto &neuv = s2->second.first;
           if (oldv != neuv) {
             auto diff = valSepDiff(ks.first.second, oldv, neuv, false);
-            if (not diff.empty()) {
-              cmp.record(ks.first, sv.first, diff,
-                         oldvec.back().second); // maybe using neuv's context?
+            if (not diff.empty() and
+                not v.changed(ks.first, sv.first, diff, sv.second.second,
+                              s2->second.second)) {
+              return stop();
             }
           }
         }
       }
     }
   }
-  cmp.groups_ = groups_; // using old group_
-  cmp.extraGroups_ = extraGroups_;
-  cmp.starGrpNames_ = starGrpNames_;
-  // std::cout << ">>>> cmp groups: "; for (auto&kv : cmp.groups_) { std::cout
-  // << kv.first << '#' << kv.second.size() << ", "; } std::cout << std::endl;
-  return cmp;
+  ICF_TRACE2(diff_done, reverse, 1);
+  return true;
+}
+
+// same steps as diffWalk() takes for one symbol of one key, with the sub-keys
+// lookup done within the (header, key, symbol) group
+bool Icf::diffGroup(const SymbolGroup &mine, const SymbolGroup &other,
+                    const std::string &key, const std::string &sym,
+                    const Icf &othericf, bool reverse, DiffVisitor &v) const {
+  for (auto &se : mine) {
+    IcfKey k = make_pair(se.first, key);
+    auto &myv = se.second.first;
+    auto &myenv = se.second.second;
+    if (not othericf.opts_->spill->hasKey(k)) { // no such key in other
+      bool found = false;
+      for (auto &sub : subkeys(k, othericf.icfSets_)) {
+        auto s3 = other.find(sub.first);
+        if (s3 == other.end()) {
+          continue; // not this sub-key for this symbol
+        }
+        found = true;
+        auto &otherv = s3->second.first;
+        if (myv != otherv) {
+          auto diff = reverse ? valSepDiff(key, otherv, myv, true)
+                              : valSepDiff(key, myv, otherv, true);
+          if (not diff.empty() and
+              not v.changed(k, sym, diff, myenv, s3->second.second)) {
+            return false;
+          }
+        }
+        break;
+      }
+      if (not found and not v.only(k, sym, se.second)) {
+        return false;
+      }
+    } else {
+      auto s2 = other.find(se.first);
+      if (s2 == other.end()) { // no symbol in other with such key
+        if (not v.only(k, sym, se.second)) {
+          return false;
+        }
+      } else if (not reverse and myv != s2->second.first) {
+        auto diff = valSepDiff(key, myv, s2->second.first, false);
+        if (not diff.empty() and
+            not v.changed(k, sym, diff, myenv, s2->second.second)) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+namespace {
+// next (header, key, symbol) group of a sorted stream, values resolved as
+// record() would have in parse order
+bool readGroup(extsort::Stream &in, extsort::Rec &cur, bool &has,
+               Icf::SymbolGroup &grp) {
+  grp.clear();
+  if (not has) {
+    return false;
+  }
+  extsort::Rec first = cur;
+  while (has and extsort::groupCompare(first, cur) == 0) {
+    auto itr = grp.find(cur.sections);
+    if (itr == grp.end()) {
+      grp[cur.sections] = make_pair(cur.value, cur.env);
+    } else if (isDefault(itr->second.second) or not isDefault(cur.env)) {
+      itr->second = make_pair(cur.value, cur.env);
+    }
+    has = in.next(cur);
+  }
+  return true;
+}
 }
 
-std::string Icf::nextGrpName(unsigned sz) const {
-  unsigned q = grpNamCounter_ / grpNamCombs_.size();
-  auto nam = "GRP@" + std::to_string(sz) + "_" +
-             grpNamCombs_[grpNamCounter_ % grpNamCombs_.size()];
-  grpNamCounter_++;
-  if (q > 0) {
-    nam += "_" + std::to_string(q);
+void Icf::streamDiff(const Icf &old, const Icf &neu, std::ostream &output) {
+  Icf fwd = old.cmpShell(), rev = neu.cmpShell();
+  Recorder fwdRec(fwd, old, false), revRec(rev, neu, true);
+  old.setKVSEPS();
+  neu.setKVSEPS();
+  auto os = old.opts_->spill->sorted();
+  auto ns = neu.opts_->spill->sorted();
+  extsort::Rec ro, rn;
+  bool ho = os->next(ro), hn = ns->next(rn);
+  SymbolGroup go, gn;
+  while (ho or hn) {
+    int c = not ho ? 1 : not hn ? -1 : extsort::groupCompare(ro, rn);
+    auto &at = c <= 0 ? ro : rn;
+    std::string key = at.key, sym = at.sym;
+    go.clear();
+    gn.clear();
+    if (c <= 0) {
+      readGroup(*os, ro, ho, go);
+    }
+    if (c >= 0) {
+      readGroup(*ns, rn, hn, gn);
+    }
+    ICF_TRACE2(diff_group, key.c_str(), sym.c_str());
+    old.diffGroup(go, gn, key, sym, neu, false, fwdRec);
+    neu.diffGroup(gn, go, key, sym, old, true, revRec);
+  }
+  if (showMoved()) {
+    fwd.moved_ = old.movedSymbols(neu);
+  }
+  output << fwd;
+  output << rev;
+}
+
+// by content, so a set has the same name whatever else is named, in whatever
+// order; only when another set took that name is a _1, _2.. suffix added
+std::string Icf::nextGrpName(const Set &s) const {
+  auto &combs = getGrpNamCombs();
+  auto h = sophoi::fnv1a(sophoi::join("\x1f", begin(s), end(s)));
+  auto base = "GRP@" + std::to_string(s.size()) + "_" + combs[h % combs.size()];
+  auto nam = base;
+  for (unsigned q = 1; custGrpNames_.count(nam) or groups_.count(nam) or
+                       extraGroups_.count(nam);
+       ++q) {
+    nam = base + "_" + std::to_string(q);
   }
   custGrpNames_.insert(nam);
   return nam;
 }
 
+namespace {
+void pad(std::string &out, const std::string &s, size_t width) {
+  out += s;
+  if (s.size() < width) {
+    out.append(width - s.size(), ' ');
+  }
+}
+}
+
+/* sections are described in parallel, named in order (names depend on those
+ * given before), then formatted in parallel and written in order as each
+ * is done; OUTPUT_FORMAT=ndjson gives one json object per line instead,
+ * SHOW_ORIGIN=1 appends file:line (old<->new for diffs) of every value
+ */
 void Icf::output_to(std::ostream &output) const {
+  ICF_TRACE1(output_start, store_.size());
+  ensureDerived();
   const char *prefix = getenv("DISPLAY_PREFIX");
   if (!prefix) {
     prefix = "";
   }
-  char buf[512];
-  typedef std::map<std::string,
-                   std::map<std::string, std::map<std::string, std::string>>>
-  SortedStore;
-  SortedStore ss;
+  const char *fmt = getenv("OUTPUT_FORMAT");
+  bool ndjson = fmt and std::string(fmt) == "ndjson";
+  bool showOrigin = ::showOrigin();
+  struct Entry {
+    const IcfKey *key;
+    const std::string *value;
+    const SetWithEnv *syms;
+    Set set;
+    Desc desc;
+    std::string name;
+  };
+  typedef std::vector<Entry> Section;
+  std::map<std::string, Section> bySection;
   unsigned kwidth = 0, gwidth = 0;
-  for (auto &kv : store_) {
+  auto view = inverted();
+  for (auto &kv : view) {
     for (auto &vs : kv.second) {
-      Set syms, groupdescs;
-      for (auto &se : vs.second) {
-        syms.insert(se.first);
-        groupdescs.insert(se.second);
+      bySection[kv.first.first].push_back(
+          Entry{&kv.first, &vs.first, &vs.second, Set(), Desc(), ""});
+    }
+  }
+  std::vector<std::pair<const std::string *, Section *>> sections;
+  for (auto &ss : bySection) {
+    sections.push_back(make_pair(&ss.first, &ss.second));
+    if (ss.first.length() > kwidth) {
+      kwidth = ss.first.length();
+    }
+  }
+
+  // a set that is exactly the symbols of one fingerprint (of a diff) recurs
+  // at every key they changed at, and is described once for all of them
+  std::unordered_map<unsigned long long, size_t> clusterSize;
+  for (auto &sf : fingerprints_) {
+    clusterSize[sf.second]++;
+  }
+  auto cluster = [&](const Set &s, unsigned long long &fp) {
+    auto f = s.empty() ? fingerprints_.end() : fingerprints_.find(*s.begin());
+    if (f == fingerprints_.end() or clusterSize.at(f->second) != s.size()) {
+      return false;
+    }
+    for (auto &sym : s) {
+      auto g = fingerprints_.find(sym);
+      if (g == fingerprints_.end() or g->second != f->second) {
+        return false;
+      }
+    }
+    fp = f->second;
+    return true;
+  };
+  std::mutex describedMutex;
+  std::map<std::pair<unsigned long long, Set>, Desc> described;
+
+  sophoi::parallelFor(sections.size(), [&](size_t i) {
+    auto &entries = *sections[i].second;
+    std::sort(begin(entries), end(entries), [](const Entry &a, const Entry &b) {
+      return a.key->second != b.key->second ? a.key->second < b.key->second
+                                            : *a.value < *b.value;
+    });
+    for (auto &e : entries) {
+      Set groupdescs;
+      for (auto &se : *e.syms) {
+        e.set.insert(se.first);
+        groupdescs.insert(*provenance(se.second).groupdesc);
       }
-      auto grpDsc = groupDesc(syms, groupdescs);
-      ss[kv.first.first][grpDsc][kv.first.second] = vs.first;
-      if (kv.first.first.length() > kwidth) {
-        kwidth = kv.first.first.length();
+      unsigned long long fp;
+      if (not cluster(e.set, fp)) {
+        e.desc = describe(e.set, groupdescs);
+        continue;
       }
-      if (grpDsc.length() > gwidth) {
-        gwidth = grpDsc.length();
+      auto ck = make_pair(fp, std::move(groupdescs));
+      {
+        std::lock_guard<std::mutex> lock(describedMutex);
+        auto d = described.find(ck);
+        if (d != described.end()) {
+          e.desc = d->second;
+          continue;
+        }
+      }
+      e.desc = describe(e.set, ck.second); // pure, so a race only repeats it
+      std::lock_guard<std::mutex> lock(describedMutex);
+      described.emplace(std::move(ck), e.desc);
+    }
+  });
+  for (auto &sec : sections) {
+    for (auto &e : *sec.second) {
+      e.name = nameDesc(e.set, e.desc);
+      if (e.name.length() > gwidth) {
+        gwidth = e.name.length();
       }
     }
   }
   if (gwidth > 30) {
     gwidth = 30;
   }
-  for (auto &kg : ss) {
-    for (auto &gv : kg.second) {
-      snprintf(buf, sizeof(buf), "%-*s  %-*s", kwidth, kg.first.c_str(), gwidth,
-               gv.first.c_str());
-      output << prefix << buf;
-      for (auto &vs : gv.second) {
-        snprintf(buf, sizeof(buf), "  %s=%s", vs.first.c_str(),
-                 vs.second.c_str());
-        output << buf;
-      }
-      output << std::endl;
+
+  std::vector<std::string> texts(sections.size());
+  std::string buf;
+  auto flush = [&](size_t atleast) {
+    if (buf.size() >= atleast) {
+      output.write(buf.data(), buf.size());
+      buf.clear();
     }
-  }
+  };
+  sophoi::parallelFor(
+      sections.size(),
+      [&](size_t i) {
+        // group desc -> key -> value
+        std::map<std::string, std::map<std::string, std::string>> lines;
+        std::map<std::string, std::set<Origin>> lineOrigins;
+        for (auto &e : *sections[i].second) {
+          lines[e.name][e.key->second] = *e.value;
+          if (showOrigin) {
+            for (auto &se : *e.syms) {
+              lineOrigins[e.name].insert(se.second);
+            }
+          }
+        }
+        auto &text = texts[i];
+        for (auto &gv : lines) {
+          Set wheres;
+          for (auto o : lineOrigins[gv.first]) {
+            wheres.insert(where(o));
+          }
+          if (ndjson) {
+            text += "{\"section\":" + sophoi::jsonQuote(*sections[i].first) +
+                    ",\"group\":" + sophoi::jsonQuote(gv.first) + ",\"kv\":{";
+            for (auto &kv : gv.second) {
+              text += sophoi::jsonQuote(kv.first) + ':' +
+                      sophoi::jsonQuote(kv.second) + ',';
+            }
+            text.back() = '}';
+            if (showOrigin) {
+              text += ",\"origins\":[";
+              for (auto &w : wheres) {
+                text += sophoi::jsonQuote(w) + ',';
+              }
+              text.back() = ']';
+            }
+            text += "}\n";
+            continue;
+          }
+          text += prefix;
+          pad(text, *sections[i].first, kwidth);
+          text += "  ";
+          pad(text, gv.first, gwidth);
+          for (auto &kv : gv.second) {
+            text += "  " + kv.first + '=' + kv.second;
+          }
+          if (showOrigin) {
+            text += "  @ " + sophoi::join(",", begin(wheres), end(wheres));
+          }
+          text += '\n';
+        }
+      },
+      [&](size_t i) {
+        buf += texts[i];
+        std::string().swap(texts[i]);
+        flush(1 << 20);
+      });
 
   int linePrted = 0;
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
   for (auto &grp : custGrpNames_) {
     bool isStar = '*' == grp[grp.size() - 1] and starGrpNames_.find(grp) !=
                   starGrpNames_.end();
@@ -794,13 +2017,176 @@ void Icf::output_to(std::ostream &output) const {
                   << std::endl;
       continue;
     }
+    auto &s = isStar ? starGrpNames_[grp] : seenGroups_[grp];
+    if (ndjson) {
+      buf += "{\"group\":" + sophoi::jsonQuote(grp) + ",\"members\":[";
+      for (auto &m : s) {
+        buf += sophoi::jsonQuote(m) + ',';
+      }
+      if (s.empty()) {
+        buf += ']';
+      } else {
+        buf.back() = ']';
+      }
+      buf += "}\n";
+      continue;
+    }
     if (! linePrted ++) {
-      output << std::endl;
+      buf += '\n';
+    }
+    buf += prefix;
+    buf += "> '" + grp + "': " + sophoi::join(",", begin(s), end(s)) + '\n';
+  }
+  if (showMoved()) {
+    for (auto &mv : moved_) {
+      auto &was = mv.second.first, &is = mv.second.second;
+      if (ndjson) {
+        auto list = [](const Set &gs) {
+          std::vector<std::string> qs;
+          for (auto &g : gs) {
+            qs.push_back(sophoi::jsonQuote(g));
+          }
+          return '[' + sophoi::join(",", begin(qs), end(qs)) + ']';
+        };
+        buf += "{\"moved\":" + sophoi::jsonQuote(mv.first) +
+               ",\"from\":" + list(was) + ",\"to\":" + list(is) + "}\n";
+        continue;
+      }
+      buf += prefix;
+      buf += ">> moved '" + mv.first +
+             "': " + sophoi::join(",", begin(was), end(was)) + " -> " +
+             sophoi::join(",", begin(is), end(is)) + '\n';
+    }
+  }
+  flush(0);
+  ICF_TRACE1(output_done, sections.size());
+}
+
+/* one item per line, fields separated by ' ' which never occurs in them:
+ * @group name member...    @extra name member...    @star name group...
+ * @cust name               = sections key symbol value context
+ * @moved symbol group... | group...    @key sections key (for no symbol kept)
+ */
+void Icf::dump_to(std::ostream &output) const {
+  ensureDerived();
+  const std::pair<const char *, const Groups *> grps[] = {
+      {"@group", &groups_}, {"@extra", &extraGroups_}, {"@star", &starGrpNames_}};
+  for (auto &tg : grps) {
+    for (auto &kv : *tg.second) {
+      output << tg.first << ' ' << kv.first;
+      for (auto &sym : kv.second) {
+        output << ' ' << sym;
+      }
+      output << '\n';
+    }
+  }
+  std::lock_guard<std::recursive_mutex> lock(*mutex_);
+  for (auto &grp : custGrpNames_) {
+    output << "@cust " << grp << '\n';
+  }
+  for (auto &mv : moved_) {
+    output << "@moved " << mv.first;
+    for (auto &grp : mv.second.first) {
+      output << ' ' << grp;
+    }
+    output << " |";
+    for (auto &grp : mv.second.second) {
+      output << ' ' << grp;
+    }
+    output << '\n';
+  }
+  // origins by id, before records using them; ids are only valid within
+  // this process so undump gives them new ones
+  std::set<Origin> dumped = {NOORIGIN};
+  std::function<void(Origin)> dumpOrigin = [&](Origin o) {
+    if (not dumped.insert(o).second) {
+      return;
+    }
+    auto &p = provenance(o);
+    if (p.other != NOORIGIN) {
+      dumpOrigin(p.other);
+      Origin mine = origin(*p.file, p.line, *p.groupdesc);
+      dumpOrigin(mine);
+      output << "@pair " << o << ' ' << mine << ' ' << p.other << ' '
+             << p.reverse << '\n';
+    } else {
+      output << "@origin " << o << ' ' << p.line << ' ' << *p.groupdesc << ' '
+             << *p.file << '\n';
+    }
+  };
+  for (auto &ks : store_) {
+    if (ks.second.empty()) {
+      output << "@key " << ks.first.first << ' ' << ks.first.second << '\n';
+    }
+    for (auto &sv : ks.second) {
+      dumpOrigin(sv.second.second);
+      output << "= " << ks.first.first << ' ' << ks.first.second << ' '
+             << sv.first << ' ' << sv.second.first << ' ' << sv.second.second
+             << '\n';
+    }
+  }
+}
+
+// dumps of disjoint shards of the same run make up the whole of it
+Icf Icf::undump(const std::vector<std::istream *> &dumps) {
+  Icf icf;
+  icf.derived_ = true; // dumped along
+  std::string line;
+  for (auto in : dumps) {
+    std::map<std::string, Origin> origins = {{"0", NOORIGIN}}; // dumped -> new
+    auto known = [&](const std::string &id) {
+      auto itr = origins.find(id);
+      if (itr == origins.end()) {
+        std::cerr << "-- unknown origin in dump line: " << line << std::endl;
+        exit(-1);
+      }
+      return itr->second;
+    };
+    while (getline(*in, line)) {
+      auto parts = sophoi::split(line);
+      if (parts.size() == 6 and parts[0] == "=") {
+        icf.record(make_pair(parts[1], parts[2]), parts[3], parts[4],
+                   known(parts[5]));
+      } else if (parts.size() >= 5 and parts[0] == "@origin") {
+        // file name is the rest of the line after the fourth space, spaces
+        // and all, whatever the fields before it hold
+        size_t at = 0;
+        for (int i = 0; i < 4; ++i) {
+          at = line.find(' ', at) + 1;
+        }
+        origins[parts[1]] = origin(line.substr(at),
+                                   strtoul(parts[2].c_str(), NULL, 10),
+                                   parts[3]);
+      } else if (parts.size() == 5 and parts[0] == "@pair") {
+        origins[parts[1]] =
+            origin(known(parts[2]), known(parts[3]), parts[4] == "1");
+      } else if (parts.size() >= 3 and parts[0] == "@moved") {
+        // shards see all groups, so each has the same, merged all the same
+        auto bar = std::find(begin(parts) + 2, end(parts), "|");
+        if (bar == end(parts)) {
+          std::cerr << "-- bad dump line: " << line << std::endl;
+          exit(-1);
+        }
+        auto &mv = icf.moved_[parts[1]];
+        mv.first.insert(begin(parts) + 2, bar);
+        mv.second.insert(bar + 1, end(parts));
+      } else if (parts.size() == 3 and parts[0] == "@key") {
+        icf.present(make_pair(parts[1], parts[2]));
+      } else if (parts.size() == 2 and parts[0] == "@cust") {
+        icf.custGrpNames_.insert(parts[1]);
+      } else if (parts.size() >= 2 and parts[0][0] == '@') {
+        Groups &grps = parts[0] == "@group"
+                           ? icf.groups_
+                           : parts[0] == "@extra" ? icf.extraGroups_
+                                                  : icf.starGrpNames_;
+        grps[parts[1]] = Set(begin(parts) + 2, end(parts));
+      } else if (not line.empty()) {
+        std::cerr << "-- bad dump line: " << line << std::endl;
+        exit(-1);
+      }
     }
-    auto &s = isStar ? starGrpNames_[grp] : seenGroups_[grp];
-    output << prefix << "> '" << grp
-           << "': " << sophoi::join(",", begin(s), end(s)) << std::endl;
   }
+  return icf;
 }
 
 std::ostream &operator<<(std::ostream &o, const Icf &c) {
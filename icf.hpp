@@ -7,17 +7,55 @@
 #include <set>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <iosfwd>
+#include <stdint.h>
 
 class PathFinder;
+namespace extsort {
+class Spiller;
+}
+namespace groupexpr {
+class Cache;
+}
+namespace sophoi {
+struct LexLine;
+}
+namespace icfio {
+class Prefetcher;
+}
+namespace icfprof {
+class Profile;
+}
+namespace detail {
+// line without surrounding whitespace, and with sharpen without its # or //
+// comment; #include and other directive lines are not right trimmed
+std::string trim(const std::string &line, bool sharpen = false);
+}
 class Icf {
   Icf() {}
   Icf &operator=(const Icf &) = delete;
 
 public:
   typedef std::set<std::string> Set;
-  typedef std::pair<std::string, std::string> WithEnv;
-  // [symbol/value] and context of definition (group def for now)
-  typedef std::map<std::string, std::string> SetWithEnv;
+  // context of definition: an id into a table of provenances shared by all
+  // trees of the process, so a symbol's value costs 4 bytes of context
+  typedef uint32_t Origin;
+  static const Origin NOORIGIN = 0;
+  struct Provenance {
+    const std::string *file, *groupdesc; // interned
+    unsigned line;
+    Origin other; // of a diff: origin of the value on the other side
+    bool reverse; // other side is the old one
+  };
+  static Origin origin(const std::string &file, unsigned line,
+                       const std::string &groupdesc);
+  static Origin origin(Origin mine, Origin other, bool reverse);
+  static const Provenance &provenance(Origin o); // lock free
+  static std::string where(Origin o); // file:line, or old<->new of a diff
+  typedef std::pair<std::string, Origin> WithEnv;
+  // [symbol/value] and context of definition
+  typedef std::map<std::string, Origin> SetWithEnv;
   // defined sets (and their intersections?)
   typedef std::map<std::string, Set> Groups; // name -> set of symbols
 
@@ -33,40 +71,123 @@ public:
       return a.first == b.first and a.second == b.second;
     }
   };
-  // context is the group defined; context can be further explored to even
-  // include change trace, then we need to mark a value as active or not, seems
-  // not wort it yet
-  // IcfKey.symbol can have multiple values in key->value(s)->{}, what's the
-  // final value then? need to remove other value entries on new value
-  // key -> symbol -> [ value  : context ]
-  typedef std::unordered_map<IcfKey,
-                             std::map<std::string, std::vector<WithEnv>>,
-                             Hasher, Equaler> StoreHelper;
+  // key -> symbol -> ( value : context ), the final value of each symbol
+  typedef std::unordered_map<IcfKey, std::map<std::string, WithEnv>, Hasher,
+                             Equaler> Store;
   // key -> value  -> { symbol : context }  ==> find set of symbols that have
   // (key,value) ==> describe such symbols by predefined group names with help
-  // of context
+  // of context; made from Store for output only
   typedef std::unordered_map<IcfKey, std::map<std::string, SetWithEnv>, Hasher,
-                             Equaler> Store; // key -> value -> symbol set
+                             Equaler> Inverted;
+  // key -> symbol -> [ value : context ], every value set in order
+  typedef std::unordered_map<IcfKey,
+                             std::map<std::string, std::vector<WithEnv>>,
+                             Hasher, Equaler> History;
   // header => { section_string : [ sorted sections ] }
   typedef std::map<std::string, std::map<std::string, std::vector<std::string>>>
   SectionSets;
+  typedef std::map<std::string, long long> Sources; // file -> mtime in ns
+  // sections -> [ value : context ] of one (header, key, symbol)
+  typedef std::map<std::string, WithEnv> SymbolGroup;
+
+  // parse-time options shared down the include tree
+  struct Options {
+    Options(); // filters from env
+    // keep only keys whose section header (or symbol) hashes to shard
+    unsigned shard = 0, shards = 1;
+    bool shardBySymbol = false;
+    // only check syntax and semantics: no store, no derived groups
+    bool validateOnly = false;
+    // collect every error instead of exiting on the first one
+    bool collectErrors = false;
+    std::vector<std::string> errors;
+    // keep every value a symbol is set to, not just the final one
+    bool history = false;
+    // runs of body lines between directives are parsed in chunks on all
+    // cores, into partial stores merged in order (PARALLEL_PARSE)
+    bool parallelParse = false;
+    // included files are read ahead of the parser (PREFETCH)
+    std::shared_ptr<icfio::Prefetcher> prefetch;
+    // cost of each include node is kept here (icfdiff --profile)
+    std::shared_ptr<icfprof::Profile> profile;
+    // records go to sorted runs on disk instead of the store (streamDiff)
+    std::shared_ptr<extsort::Spiller> spill;
+    // filters: what is dropped is never stored, expanded or diffed; a key
+    // defined only for symbols SELECT_SYMBOLS or a symbol shard drops stays
+    // in the store without symbols, so diff falls back to its sub-keys only
+    // where a whole run would
+    Set ignored;                      // IGNORED_ITEMS, also out of groupdefs
+    std::vector<std::string> headers; // SELECT_SECTIONS, header prefixes
+    Set exactHeaders;                 // SELECT_SECTIONS given as header:*
+    Set keys;                         // SELECT_KEYS
+    Set symbols;                      // SELECT_SYMBOLS
+    bool keepHeader(const std::string &sections) const;
+    bool keepKey(const std::string &key) const;
+    bool keepSymbol(const std::string &sym) const;
+  };
 
   std::vector<IcfKey> subkeys(IcfKey k,
                               const SectionSets &aset = SectionSets()) const;
   Icf(const char *fname,
       const std::set<std::string> &ancestors = std::set<std::string>(),
-      std::shared_ptr<PathFinder> pf = NULL);
+      std::shared_ptr<PathFinder> pf = NULL,
+      std::shared_ptr<Options> opts = NULL);
   void trickleDown();
-  void combineSets();
+  void combineSets() const;
+  void ensureDerived() const;
   void mergeStore(const Store &);
   Icf diff(const Icf &, bool reverse = false) const;
+  // what a diff walk finds, one (key, symbol) at a time: diff() records it
+  // into a tree described by groups, a summary only counts it. each returns
+  // false to stop the walk
+  struct DiffVisitor {
+    virtual ~DiffVisitor() {}
+    // value differs from the other tree's, diff as valSepDiff() shows it;
+    // origins of the walked tree's value and the other's, not interned as a
+    // pair, which only output with SHOW_ORIGIN needs
+    virtual bool changed(const IcfKey &k, const std::string &sym,
+                         const std::string &diff, Origin mine,
+                         Origin other) = 0;
+    // in the walked tree only: removed, or added when reverse
+    virtual bool only(const IcfKey &k, const std::string &sym,
+                      const WithEnv &v) = 0;
+  };
+  // the walk diff() takes; false if the visitor stopped it
+  bool diffWalk(const Icf &newicf, bool reverse, DiffVisitor &v) const;
+  // diff of two trees loaded with Options::spill, as a merge-join over their
+  // sorted records; prints what old.diff(neu) then neu.diff(old, true) would
+  static void streamDiff(const Icf &old, const Icf &neu, std::ostream &output);
 
   Set setByKeyValue(IcfKey k, std::string v);
   Set setByName(const std::string& name, const std::string& fname);
   std::string groupDesc(const Set &, const Set &) const;
   static std::tuple<Set, Set, Set> setRelation(Set l, Set r); // (l-r, l^r, r-l)
 
+  std::map<std::string, std::string> query(const IcfKey &k,
+                                           const std::string &sym = "") const;
+  void query_to(std::ostream &output, const IcfKey &k,
+                const std::string &sym = "") const;
+  const Sources &sources() const { return sources_; }
+  const Store &store() const { return store_; }
+  Inverted inverted() const;
+  const std::vector<WithEnv> &history(const IcfKey &k,
+                                      const std::string &sym) const;
+
   void output_to(std::ostream &output) const;
+  // lossless text form of groups and store, to merge partial (sharded) runs
+  void dump_to(std::ostream &output) const;
+  static Icf undump(const std::vector<std::istream *> &dumps);
+  // binary form of a tree as parsed, loaded again without the .icf text
+  void snapshot_to(std::ostream &output) const;
+  static Icf loadSnapshot(std::istream &input);
+  // binary delta turning this tree into newicf, and applying one in place
+  void delta_to(const Icf &newicf, std::ostream &output) const;
+  void apply(std::istream &delta);
+  unsigned long long digest() const; // of groups, sections and values
+  // flat image of store and groups for icfimage, see image.hpp
+  std::string image() const;
+  // dictionary encoded columns of store and groups, see columnar.hpp
+  void columnar_to(std::ostream &output) const;
   void setKVSEPS() const;
   std::string getKVSep(const std::string& k) const {
     if (not dftSep_.empty()) {
@@ -80,28 +201,79 @@ public:
   }
 
 private:
+  void fail(const std::string &msg) const;
+  void warn(const std::string &msg) const;
+  // (key, groupdesc) -> line first defining it, to find dups in a file
+  typedef std::map<std::pair<IcfKey, std::string>, unsigned> Defined;
+  struct Sink;    // where parsed body lines go
+  struct Direct;  // into this tree, as they are parsed
+  struct Partial; // into the partial store of a chunk of lines
+  typedef std::vector<std::pair<const char *, unsigned>> Chunks; // at lineno
+  bool expands(const sophoi::LexLine &lex) const;
+  void parseBody(const sophoi::LexLine &lex, unsigned lineno,
+                 const std::string &fname, Sink &sink) const;
+  size_t parseChunks(const Chunks &chunks, const char *end,
+                   const std::vector<std::string> &groupdescs,
+                   const std::string &fname, Defined &defined);
   void record(const IcfKey &k, std::string sym, std::string value,
-              std::string env);
+              Origin env);
+  void present(const IcfKey &k);
   IcfKey prek(const IcfKey &k, std::string prefix) const;
+  void defaultGroup();
+  void groupExpr(const std::string &text, const std::string &where);
+  void groupFile(const std::string &text, const std::string &where);
+  Set exprSet(const std::string &expr, std::string &err);
+  bool exprHasGroup(const std::string &expr) const;
+  void groupsChanged();
+  void conjunctionVariants() const;
+  void conjunctionVariants(const std::string &conj) const;
+  Icf cmpShell() const;
+  std::map<std::string, std::pair<Set, Set>>
+  movedSymbols(const Icf &newicf) const;
+  struct Recorder; // DiffVisitor filling a cmpShell()
+  void sectionSets() const;
+  bool diffGroup(const SymbolGroup &mine, const SymbolGroup &other,
+                 const std::string &key, const std::string &sym,
+                 const Icf &othericf, bool reverse, DiffVisitor &v) const;
   std::string valSepDiff(const std::string &k, const std::string &l,
                          const std::string &r, bool derivediff) const;
 
 private:
   Store store_;
-  StoreHelper storeHelper_;
-  Groups groups_;
-  Groups extraGroups_;
-  std::string nextGrpName(unsigned sz) const;
-  std::vector<std::string> grpNamCombs_;
-  mutable unsigned grpNamCounter_ = 0;
+  History history_;
+  mutable Groups groups_; // (A+B) etc. of conjunctions_ added once derived
+  mutable Groups extraGroups_;
+  Set conjunctions_; // every A^B seen, in includes too
+  std::shared_ptr<groupexpr::Cache> exprs_;
+  mutable bool derived_ = false;
+  std::string nextGrpName(const Set &s) const;
+  struct Desc {
+    std::string name;
+    enum How { DEFINED, SEEN, PLAIN, NEW } how; // NEW: needs nextGrpName
+  };
+  Desc describe(const Set &, const Set &) const;
+  std::string nameDesc(const Set &, const Desc &) const;
+  // guards the mutable state, made once derived or by naming, so a const tree
+  // is shared between threads; copies share it
+  std::shared_ptr<std::recursive_mutex> mutex_ =
+      std::make_shared<std::recursive_mutex>();
   mutable Groups seenGroups_;
+  mutable std::map<Set, std::string> seenSets_; // reverse of seenGroups_
   mutable Set custGrpNames_;
   mutable Groups starGrpNames_;
+  // of a diff: symbol -> sum of hashes of its (key, diff) records, equal for
+  // symbols that changed alike at every key; such a cluster is described once
+  std::unordered_map<std::string, unsigned long long> fingerprints_;
+  // of a diff: symbol -> (groups in old, groups in new), where these differ
+  std::map<std::string, std::pair<Set, Set>> moved_;
   std::shared_ptr<PathFinder> pf_;
+  std::shared_ptr<Options> opts_;
   Set icfSections_;
-  SectionSets icfSets_;
+  mutable SectionSets icfSets_;
+  mutable bool sectionSetsMade_ = false;
+  Sources sources_;
   mutable std::string dftSep_;
-  mutable SetWithEnv kvSepMap_;
+  mutable std::map<std::string, std::string> kvSepMap_;
 };
 
 std::ostream &operator<<(std::ostream &, const Icf &);
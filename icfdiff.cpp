@@ -1,11 +1,69 @@
 #include <iostream>
 #include <string>
+#include <vector>
 #include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
 #include <stdlib.h>
 #include "icf.hpp"
+#include "daemon.hpp"
+#include "shard.hpp"
+#include "lexcheck.hpp"
+#include "extsort.hpp"
+#include "delta.hpp"
+#include "image.hpp"
+#include "summary.hpp"
+#include "profile.hpp"
+#include "archive.hpp"
+#include "columnar.hpp"
+#include "cache.hpp"
+#include "variants.hpp"
+#include "symlist.hpp"
+
+// parse files in parallel, checking only, and report every error found
+int validateAll(const std::vector<std::string> &files) {
+  std::vector<std::shared_ptr<Icf::Options>> opts;
+  for (size_t i = 0; i < files.size(); ++i) {
+    opts.emplace_back(new Icf::Options());
+    opts.back()->validateOnly = true;
+    opts.back()->collectErrors = true;
+  }
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      Icf icf(files[i].c_str(), std::set<std::string>(), NULL, opts[i]);
+    }
+  };
+  unsigned nthreads = std::thread::hardware_concurrency();
+  if (nthreads == 0 || nthreads > files.size()) {
+    nthreads = files.size();
+  }
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < nthreads; ++i) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto &t : threads) {
+    t.join();
+  }
+  size_t nerrs = 0;
+  for (auto &o : opts) {
+    for (auto &e : o->errors) {
+      std::cerr << e << std::endl;
+    }
+    nerrs += o->errors.size();
+  }
+  if (nerrs > 0) {
+    std::cerr << "-- " << nerrs << " error(s) in " << files.size()
+              << " file(s)" << std::endl;
+    return -1;
+  }
+  return 0;
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2 && argc != 3) {
+  if (argc < 2) {
     std::cerr << "expecting 1 or 2 arg as icf file" << std::endl;
     exit(-1);
   }
@@ -16,15 +74,56 @@ int main(int argc, char **argv) {
     postfixed files in .gz paths before default; same goes for .new, .bz2, etc
   /default/path1;.new:/new/path1:/new/path2;.gz:/gz/path1:/gz/path2;/default/path2)"},
     {"EXCLUDE", "  some included .icfs aren't essential for validate/diff and if excluded speeds up"},
-    {"IGNORED_ITEMS", "  (todo) some elements jump between groups, ignoring them make diff clearer"},
+    {"IGNORED_ITEMS", R"(  some elements jump between groups, ignoring them make diff clearer;
+  comma separated, dropped from groupdefs and never stored)"},
+    {"SELECT_SECTIONS", R"(  only parse lines whose section header starts with one of these (comma
+  separated); header:* selects that header exactly)"},
+    {"SELECT_KEYS", "  only parse these (comma separated) keys"},
+    {"SELECT_SYMBOLS", "  only parse these (comma separated) symbols"},
     {"KVSEPS", "  some kv pairs have values further splittable, configure by key(sep), or ALL(,)"},
     {"DEFAULT", R"(  naturally DEFAULT group includes everything, but we can override it to contain,
   say, "Pirarras,Munduruku,Parintintin")"},
+    {"LEXER", "  cap line lexer instruction set at scalar, sse42 or avx2 (default: best)"},
+    {"PARALLEL_PARSE", R"(  1 to parse a large .icf on all cores: lines between directives are split into
+  chunks parsed on their own, then merged in order)"},
+    {"PREFETCH", R"(  1 to read the files a .icf includes, through io_uring where the kernel allows,
+  while it is still being parsed, and theirs as each read completes)"},
+    {"MEM_BUDGET", R"(  MB of parsed records icfdiff --external holds in memory before spilling
+  sorted runs to $TMPDIR (default 256))"},
     {"DISPLAY_PREFIX", "  simply prefix all output lines with a custom header"},
+    {"OUTPUT_FORMAT", "  ndjson for one json object per output line instead of aligned text"},
+    {"VALUE_HISTORY", "  1 to keep every value a symbol is set to; icfdiff -q then shows overridden ones"},
+    {"SHOW_ORIGIN", "  1 to show file:line each value comes from, old<->new for a changed one"},
+    {"SHOW_MOVED", R"(  1 to list symbols a diff finds in other groups than before, IGNORED_ITEMS
+  candidates, as ">> moved 'sym': OLD -> NEW")"},
+    {"ICFD_SOCKET", R"(  unix socket of a resident icfdiff -d; if set, requests are served there with
+  trees kept parsed between calls, falling back to local run if unreachable)"},
+    {"DIFF_CACHE", R"(  directory to keep rendered diffs in, by content digests of both trees, so
+  the same pair diffed again is read back; not used with SHOW_ORIGIN=1)"},
   };
   if (a1 == "-h") {
     std::cout << "$ icfdiff f1.icf           # validate\n"
-              << "$ icfdiff f1.icf f2.icf    # diff\n\n";
+              << "$ icfdiff f1.icf f2.icf    # diff\n"
+              << "$ icfdiff --validate f1.icf [f2.icf ...]   # check only\n"
+              << "$ icfdiff -q f1.icf sections key [symbol]  # query\n"
+              << "$ icfdiff -d /path/to/socket               # daemon\n"
+              << "$ icfdiff --shard i/N f1.icf [f2.icf]      # partial run\n"
+              << "$ icfdiff --shard-symbols i/N f1.icf [f2.icf]\n"
+              << "$ icfdiff --external f1.icf f2.icf        # out-of-core diff\n"
+              << "$ icfdiff --summary [--max-diffs N] f1 f2  # counts, exit code\n"
+              << "$ icfdiff --merge part1 ... partN          # merge partials\n"
+              << "$ icfdiff --snapshot f1.icf > f1.snap      # binary tree\n"
+              << "$ icfdiff --delta f1 f2 > d12              # binary delta\n"
+              << "$ icfdiff --apply f1 d12 > f2.snap         # apply delta\n"
+              << "$ icfdiff --publish name f1.icf            # shared memory\n"
+              << "$ icfdiff --image name sections key [symbol]  # query it\n"
+              << "$ icfdiff --columnar f1.icf > f1.col     # for analytics\n"
+              << "$ icfdiff --variants f1.icf f1.icf.nyc ...  # base, overlays\n"
+              << "$ icfdiff --profile [--folded] f1.icf    # include tree costs\n"
+              << "$ icfdiff --pack f1.icf ... > r.pack     # archive of a tree\n"
+              << "$ icfdiff --symlist syms.txt > syms.bin  # for #groupfile\n"
+              << "$ icfdiff --lexcheck f1.icf ...            # lexer check/bench\n"
+              << "$ icfdiff --lexfuzz lines [seed]           # random lexer check\n\n";
     for (auto& kv : params) {
       std::string dft;
       char * env = getenv(kv.first.c_str());
@@ -35,12 +134,181 @@ int main(int argc, char **argv) {
     }
     exit(0);
   }
-  if (argc == 2) {
-    Icf icf(argv[1]);
-    std::cout << icf << std::endl;
+  if (a1 == "-d") {
+    if (argc != 3) {
+      std::cerr << "expecting socket path to serve on" << std::endl;
+      exit(-1);
+    }
+    return icfd::serve(argv[2]);
+  }
+  if (a1 == "--shard" || a1 == "--shard-symbols") {
+    if (argc != 4 && argc != 5) {
+      std::cerr << "expecting i/N and 1 or 2 icf files" << std::endl;
+      exit(-1);
+    }
+    return icfshard::run(argv[2], a1 == "--shard-symbols",
+                         std::vector<std::string>(argv + 3, argv + argc));
+  }
+  if (a1 == "--validate") {
+    if (argc < 3) {
+      std::cerr << "expecting icf files to validate" << std::endl;
+      exit(-1);
+    }
+    return validateAll(std::vector<std::string>(argv + 2, argv + argc));
+  }
+  if (a1 == "--external") {
+    if (argc != 4) {
+      std::cerr << "expecting 2 icf files to diff" << std::endl;
+      exit(-1);
+    }
+    char *mb = getenv("MEM_BUDGET");
+    size_t budget = (mb ? strtoul(mb, NULL, 10) : 256) << 20;
+    std::shared_ptr<Icf::Options> oo(new Icf::Options()),
+        no(new Icf::Options());
+    oo->spill.reset(new extsort::Spiller(budget / 2));
+    no->spill.reset(new extsort::Spiller(budget / 2));
+    Icf old(argv[2], std::set<std::string>(), NULL, oo);
+    Icf neu(argv[3], std::set<std::string>(), NULL, no);
+    Icf::streamDiff(old, neu, std::cout);
+    return 0;
+  }
+  if (a1 == "--summary") {
+    size_t maxDiffs = size_t(-1);
+    int at = 2;
+    if (argc > 3 && std::string(argv[2]) == "--max-diffs") {
+      char *e;
+      maxDiffs = strtoul(argv[3], &e, 10);
+      if (*e != '\0' || *argv[3] == '\0') {
+        std::cerr << "-- bad --max-diffs '" << argv[3] << "'" << std::endl;
+        exit(-1);
+      }
+      at = 4;
+    }
+    if (argc != at + 2) {
+      std::cerr << "expecting 2 icf files or snapshots to summarize" << std::endl;
+      exit(-1);
+    }
+    return icfsummary::run(argv[at], argv[at + 1], maxDiffs);
+  }
+  if (a1 == "--pack") {
+    if (argc < 3) {
+      std::cerr << "expecting icf files to pack" << std::endl;
+      exit(-1);
+    }
+    return icfarc::pack(std::vector<std::string>(argv + 2, argv + argc));
+  }
+  if (a1 == "--symlist") {
+    if (argc != 3) {
+      std::cerr << "expecting symbol list file" << std::endl;
+      exit(-1);
+    }
+    return icfsyms::write(argv[2]);
+  }
+  if (a1 == "--profile") {
+    bool folded = argc == 4 && std::string(argv[2]) == "--folded";
+    if (argc != 3 && not folded) {
+      std::cerr << "expecting optional --folded and icf file to profile"
+                << std::endl;
+      exit(-1);
+    }
+    return icfprof::run(argv[argc - 1], folded);
+  }
+  if (a1 == "--lexcheck") {
+    return icflex::check(std::vector<std::string>(argv + 2, argv + argc));
+  }
+  if (a1 == "--lexfuzz") {
+    if (argc != 3 and argc != 4) {
+      std::cerr << "expecting number of lines to fuzz, and a seed" << std::endl;
+      exit(-1);
+    }
+    return icflex::fuzz(strtoul(argv[2], NULL, 10),
+                        argc == 4 ? strtoul(argv[3], NULL, 10) : 1);
+  }
+  if (a1 == "--merge") {
+    return icfshard::merge(std::vector<std::string>(argv + 2, argv + argc));
+  }
+  if (a1 == "--snapshot") {
+    if (argc != 3) {
+      std::cerr << "expecting icf file to snapshot" << std::endl;
+      exit(-1);
+    }
+    return icfdelta::snapshot(argv[2]);
+  }
+  if (a1 == "--publish") {
+    if (argc != 4) {
+      std::cerr << "expecting image name and icf file or snapshot" << std::endl;
+      exit(-1);
+    }
+    return icfimage::publishFile(argv[2], argv[3]);
+  }
+  if (a1 == "--variants") {
+    if (argc < 4) {
+      std::cerr << "expecting base icf file and its variants" << std::endl;
+      exit(-1);
+    }
+    return icfvar::run(std::vector<std::string>(argv + 2, argv + argc));
+  }
+  if (a1 == "--columnar") {
+    if (argc != 3) {
+      std::cerr << "expecting icf file or snapshot to export" << std::endl;
+      exit(-1);
+    }
+    return icfcol::write(argv[2]);
+  }
+  if (a1 == "--image") {
+    if (argc != 5 && argc != 6) {
+      std::cerr << "expecting image name, sections, key and optional symbol"
+                << std::endl;
+      exit(-1);
+    }
+    return icfimage::query(argv[2],
+                           std::vector<std::string>(argv + 3, argv + argc));
+  }
+  if (a1 == "--delta" || a1 == "--apply") {
+    if (argc != 4) {
+      std::cerr << (a1 == "--delta" ? "expecting 2 icf files or snapshots"
+                                    : "expecting icf file or snapshot, and delta")
+                << std::endl;
+      exit(-1);
+    }
+    return a1 == "--delta" ? icfdelta::delta(argv[2], argv[3])
+                           : icfdelta::apply(argv[2], argv[3]);
+  }
+
+  std::vector<std::string> args;
+  if (a1 == "-q") {
+    if (argc != 5 && argc != 6) {
+      std::cerr << "expecting icf file, sections, key and optional symbol"
+                << std::endl;
+      exit(-1);
+    }
+    args.push_back("query");
+    args.insert(args.end(), argv + 2, argv + argc);
+  } else if (argc == 2) {
+    args = {"validate", argv[1]};
   } else if (argc == 3) {
-    Icf old(argv[1]), neu(argv[2]);
-    std::cout << old.diff(neu);
-    std::cout << neu.diff(old, true);
+    args = {"diff", argv[1], argv[2]};
+  } else {
+    std::cerr << "expecting 1 or 2 arg as icf file" << std::endl;
+    exit(-1);
+  }
+  char *sock = getenv("ICFD_SOCKET");
+  if (sock) {
+    int code = icfd::request(sock, args);
+    if (code >= 0) {
+      return code;
+    }
+  }
+
+  if (args[0] == "validate") {
+    Icf icf = icfdelta::load(argv[1]);
+    std::cout << icf << std::endl;
+  } else if (args[0] == "diff") {
+    Icf old = icfdelta::load(argv[1]), neu = icfdelta::load(argv[2]);
+    icfcache::diff(old, neu, std::cout);
+  } else if (args[0] == "query") {
+    Icf icf = icfdelta::load(argv[2]);
+    icf.query_to(std::cout, make_pair(args[2], args[3]),
+                 args.size() == 5 ? args[4] : "");
   }
 }
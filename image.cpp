@@ -0,0 +1,444 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "delta.hpp"
+#include "image.hpp"
+
+using namespace std;
+
+namespace icfimage {
+const size_t SLOTS = 256;
+
+struct Control {
+  char magic[8];
+  atomic<uint64_t> generation; // current image, 0 before the first
+  atomic<uint64_t> oldest;     // oldest image not unlinked yet
+  struct Slot {
+    atomic<int32_t> pid;  // of the reader owning it, 0 if free
+    atomic<uint64_t> gen; // image the reader is in, 0 if none
+  } slots[SLOTS];
+};
+}
+
+namespace {
+using icfimage::Control;
+const char MAGIC[8] = {'I', 'C', 'F', 'I', 'M', 'G', '1', '\0'};
+
+// everything is an offset from the start of the image, so it reads the same
+// wherever it is mapped; arrays are sorted for binary search
+struct Str {
+  uint32_t off, len; // in the string pool
+};
+struct Key {
+  Str sections, key;
+  uint64_t syms, nsyms; // range of Sym, sorted by symbol
+};
+struct Sym {
+  Str sym, value;
+};
+struct Group {
+  Str name;
+  uint64_t members, nmembers; // range of Str
+};
+struct Header {
+  char magic[8];
+  uint64_t size;
+  uint64_t keys, nkeys, syms, nsyms, groups, ngroups, members, nmembers;
+  uint64_t pool;
+};
+
+class View {
+  const char *base_;
+  const Header *h_;
+
+public:
+  explicit View(const char *base)
+      : base_(base), h_(reinterpret_cast<const Header *>(base)) {}
+  template <typename T> const T *at(uint64_t off) const {
+    return reinterpret_cast<const T *>(base_ + off);
+  }
+  int compare(const Str &s, const string &t) const {
+    int c = memcmp(base_ + h_->pool + s.off, t.data(),
+                   min<size_t>(s.len, t.size()));
+    return c != 0 ? c : s.len < t.size() ? -1 : s.len > t.size() ? 1 : 0;
+  }
+  string str(const Str &s) const {
+    return string(base_ + h_->pool + s.off, s.len);
+  }
+  const Header &header() const { return *h_; }
+};
+
+// an image is only read once its header and every range in it are within
+// its size, so a bad or foreign segment is refused rather than read past
+template <typename T>
+bool within(uint64_t off, uint64_t n, uint64_t end) {
+  return off % alignof(T) == 0 and off <= end and n <= (end - off) / sizeof(T);
+}
+
+bool valid(const char *base, size_t size) {
+  if (size < sizeof(Header)) {
+    return false;
+  }
+  View v(base);
+  auto &h = v.header();
+  if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 or h.size != size or
+      not within<Key>(h.keys, h.nkeys, size) or
+      not within<Sym>(h.syms, h.nsyms, size) or
+      not within<Group>(h.groups, h.ngroups, size) or
+      not within<Str>(h.members, h.nmembers, size) or h.pool > size) {
+    return false;
+  }
+  auto str = [&](const Str &s) {
+    return s.off + uint64_t(s.len) <= size - h.pool;
+  };
+  auto keys = v.at<Key>(h.keys);
+  for (uint64_t i = 0; i < h.nkeys; ++i) {
+    if (not str(keys[i].sections) or not str(keys[i].key) or
+        keys[i].syms > h.nsyms or keys[i].nsyms > h.nsyms - keys[i].syms) {
+      return false;
+    }
+  }
+  auto syms = v.at<Sym>(h.syms);
+  for (uint64_t i = 0; i < h.nsyms; ++i) {
+    if (not str(syms[i].sym) or not str(syms[i].value)) {
+      return false;
+    }
+  }
+  auto grps = v.at<Group>(h.groups);
+  for (uint64_t i = 0; i < h.ngroups; ++i) {
+    if (not str(grps[i].name) or grps[i].members > h.nmembers or
+        grps[i].nmembers > h.nmembers - grps[i].members) {
+      return false;
+    }
+  }
+  auto mems = v.at<Str>(h.members);
+  for (uint64_t i = 0; i < h.nmembers; ++i) {
+    if (not str(mems[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+string shmName(const string &name, uint64_t gen = 0) {
+  return '/' + name + (gen ? '.' + to_string(gen) : "");
+}
+
+void die(const string &what) {
+  cerr << "-- " << what << ": " << strerror(errno) << endl;
+  exit(-1);
+}
+
+Control *control(const string &name, bool create, int *fdOut = NULL) {
+  int fd = shm_open(shmName(name).c_str(), create ? O_RDWR | O_CREAT : O_RDWR,
+                    0644);
+  if (fd < 0) {
+    if (not create and errno == ENOENT) {
+      cerr << "-- no config image published as " << name << endl;
+      exit(-1);
+    }
+    die("cannot open shared memory " + shmName(name));
+  }
+  if (create) {
+    flock(fd, LOCK_EX); // one publisher at a time
+    struct stat st;
+    if (fstat(fd, &st) == 0 and size_t(st.st_size) < sizeof(Control) and
+        ftruncate(fd, sizeof(Control)) != 0) {
+      die("cannot size shared memory " + shmName(name));
+    }
+  }
+  void *p = mmap(NULL, sizeof(Control), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  if (p == MAP_FAILED) {
+    die("cannot map shared memory " + shmName(name));
+  }
+  if (fdOut) {
+    *fdOut = fd;
+  } else {
+    close(fd);
+  }
+  auto ctl = static_cast<Control *>(p);
+  if (not create and memcmp(ctl->magic, MAGIC, sizeof(MAGIC)) != 0) {
+    cerr << "-- not a config image: " << shmName(name) << endl;
+    exit(-1);
+  }
+  return ctl;
+}
+
+bool alive(int32_t pid) {
+  return pid == 0 or kill(pid, 0) == 0 or errno != ESRCH;
+}
+
+// unlink images older than the current one no reader is in, clearing slots
+// of readers gone without a word
+void reclaim(Control *ctl, const string &name) {
+  uint64_t cur = ctl->generation.load();
+  uint64_t oldest = cur;
+  for (uint64_t g = ctl->oldest.load(); g < cur; ++g) {
+    bool inUse = false;
+    for (auto &s : ctl->slots) {
+      if (s.gen.load() == g) {
+        if (alive(s.pid.load())) {
+          inUse = true;
+        } else {
+          s.gen.store(0);
+          s.pid.store(0);
+        }
+      }
+    }
+    if (inUse) {
+      oldest = min(oldest, g);
+    } else {
+      shm_unlink(shmName(name, g).c_str());
+    }
+  }
+  ctl->oldest.store(oldest);
+}
+}
+
+// keys sorted by (sections, key), groups by name, strings pooled once
+std::string Icf::image() const {
+  std::vector<const Store::value_type *> keys;
+  size_t nsyms = 0, nmembers = 0;
+  for (auto &ks : store_) {
+    keys.push_back(&ks);
+    nsyms += ks.second.size();
+  }
+  sort(begin(keys), end(keys),
+       [](const Store::value_type *a, const Store::value_type *b) {
+         return a->first < b->first;
+       });
+  for (auto &kv : groups_) {
+    nmembers += kv.second.size();
+  }
+  Header h;
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.keys = sizeof(Header);
+  h.nkeys = keys.size();
+  h.syms = h.keys + h.nkeys * sizeof(Key);
+  h.nsyms = nsyms;
+  h.groups = h.syms + h.nsyms * sizeof(Sym);
+  h.ngroups = groups_.size();
+  h.members = h.groups + h.ngroups * sizeof(Group);
+  h.nmembers = nmembers;
+  h.pool = h.members + h.nmembers * sizeof(Str);
+
+  std::string img(h.pool, '\0'), pool;
+  std::unordered_map<std::string, Str> pooled;
+  auto str = [&](const std::string &s) {
+    auto itr = pooled.find(s);
+    if (itr != pooled.end()) {
+      return itr->second;
+    }
+    if (pool.size() + s.size() > UINT32_MAX) {
+      std::cerr << "-- config image strings over 4GB" << std::endl;
+      exit(-1);
+    }
+    Str r = {uint32_t(pool.size()), uint32_t(s.size())};
+    pool += s;
+    pooled.emplace(s, r);
+    return r;
+  };
+  auto key = reinterpret_cast<Key *>(&img[h.keys]);
+  auto sym = reinterpret_cast<Sym *>(&img[h.syms]);
+  uint64_t si = 0;
+  for (auto ks : keys) {
+    *key++ = {str(ks->first.first), str(ks->first.second), si,
+              ks->second.size()};
+    for (auto &sv : ks->second) {
+      sym[si++] = {str(sv.first), str(sv.second.first)};
+    }
+  }
+  auto grp = reinterpret_cast<Group *>(&img[h.groups]);
+  auto mem = reinterpret_cast<Str *>(&img[h.members]);
+  uint64_t mi = 0;
+  for (auto &kv : groups_) {
+    *grp++ = {str(kv.first), mi, kv.second.size()};
+    for (auto &m : kv.second) {
+      mem[mi++] = str(m);
+    }
+  }
+  img += pool;
+  h.size = img.size();
+  memcpy(&img[0], &h, sizeof(h));
+  return img;
+}
+
+namespace icfimage {
+void publish(const Icf &icf, const std::string &name) {
+  auto img = icf.image();
+  int cfd;
+  Control *ctl = control(name, true, &cfd);
+  uint64_t gen = ctl->generation.load() + 1;
+  auto seg = shmName(name, gen);
+  int fd = shm_open(seg.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 or ftruncate(fd, img.size()) != 0) {
+    die("cannot create shared memory " + seg);
+  }
+  void *p = mmap(NULL, img.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    die("cannot map shared memory " + seg);
+  }
+  memcpy(p, img.data(), img.size());
+  munmap(p, img.size());
+  close(fd);
+  bool first = memcmp(ctl->magic, MAGIC, sizeof(MAGIC)) != 0;
+  if (first) {
+    ctl->oldest.store(gen);
+  }
+  ctl->generation.store(gen); // the swap: readers entering now get gen
+  if (first) { // readers may attach now there is an image
+    memcpy(ctl->magic, MAGIC, sizeof(MAGIC));
+  }
+
+  // grace period: readers still in an old image leave it after their query
+  for (int i = 0; i < 1000 and ctl->oldest.load() < gen; ++i) {
+    reclaim(ctl, name);
+    if (ctl->oldest.load() < gen) {
+      this_thread::sleep_for(chrono::milliseconds(1));
+    }
+  }
+  munmap(ctl, sizeof(Control));
+  close(cfd); // and the lock
+}
+
+Reader::Reader(const std::string &name) : name_(name) {
+  ctl_ = control(name, false);
+  int32_t me = getpid();
+  for (;;) {
+    for (slot_ = 0; slot_ < SLOTS; ++slot_) {
+      auto &s = ctl_->slots[slot_];
+      int32_t pid = s.pid.load();
+      if ((pid == 0 or not alive(pid)) and
+          s.pid.compare_exchange_strong(pid, me)) {
+        s.gen.store(0);
+        return;
+      }
+    }
+    std::cerr << "-- all " << SLOTS << " reader slots of " << name
+              << " taken, waiting" << std::endl;
+    this_thread::sleep_for(chrono::seconds(1));
+  }
+}
+
+Reader::~Reader() {
+  if (image_) {
+    munmap(const_cast<char *>(image_), size_);
+  }
+  ctl_->slots[slot_].gen.store(0);
+  ctl_->slots[slot_].pid.store(0);
+  munmap(ctl_, sizeof(Control));
+}
+
+// announce the generation about to be read, then check it is still current:
+// a publisher either sees it announced, or has swapped and we retry, so an
+// image is never unlinked between reading its generation and mapping it
+const char *Reader::enter() {
+  auto &slot = ctl_->slots[slot_];
+  uint64_t gen;
+  do {
+    gen = ctl_->generation.load();
+    slot.gen.store(gen);
+  } while (ctl_->generation.load() != gen);
+  if (gen != mappedGen_) {
+    if (image_) {
+      munmap(const_cast<char *>(image_), size_);
+    }
+    auto seg = shmName(name_, gen);
+    int fd = shm_open(seg.c_str(), O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 or fstat(fd, &st) != 0) {
+      die("cannot open shared memory " + seg);
+    }
+    size_ = st.st_size;
+    void *p = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      die("cannot map shared memory " + seg);
+    }
+    image_ = static_cast<const char *>(p);
+    mappedGen_ = gen;
+    if (not valid(image_, size_)) {
+      cerr << "-- not a config image: " << seg << endl;
+      exit(-1);
+    }
+  }
+  return image_;
+}
+
+void Reader::leave() { ctl_->slots[slot_].gen.store(0); }
+
+std::map<std::string, std::string> Reader::query(const std::string &sections,
+                                                 const std::string &key,
+                                                 const std::string &sym) {
+  std::map<std::string, std::string> ret;
+  View v(enter());
+  auto &h = v.header();
+  auto keys = v.at<Key>(h.keys);
+  auto k = lower_bound(keys, keys + h.nkeys, 0, [&](const Key &e, int) {
+    int c = v.compare(e.sections, sections);
+    return c != 0 ? c < 0 : v.compare(e.key, key) < 0;
+  });
+  if (k != keys + h.nkeys and v.compare(k->sections, sections) == 0 and
+      v.compare(k->key, key) == 0) {
+    auto syms = v.at<Sym>(h.syms) + k->syms;
+    auto b = syms, e = syms + k->nsyms;
+    if (not sym.empty()) {
+      b = lower_bound(b, e, 0, [&](const Sym &s, int) {
+        return v.compare(s.sym, sym) < 0;
+      });
+      e = b != e and v.compare(b->sym, sym) == 0 ? b + 1 : b;
+    }
+    for (auto s = b; s != e; ++s) {
+      ret[v.str(s->sym)] = v.str(s->value);
+    }
+  }
+  leave();
+  return ret;
+}
+
+std::vector<std::string> Reader::members(const std::string &group) {
+  std::vector<std::string> ret;
+  View v(enter());
+  auto &h = v.header();
+  auto grps = v.at<Group>(h.groups);
+  auto g = lower_bound(grps, grps + h.ngroups, 0, [&](const Group &e, int) {
+    return v.compare(e.name, group) < 0;
+  });
+  if (g != grps + h.ngroups and v.compare(g->name, group) == 0) {
+    auto m = v.at<Str>(h.members) + g->members;
+    for (uint64_t i = 0; i < g->nmembers; ++i) {
+      ret.push_back(v.str(m[i]));
+    }
+  }
+  leave();
+  return ret;
+}
+
+int publishFile(const std::string &name, const std::string &fname) {
+  publish(icfdelta::load(fname), name);
+  return 0;
+}
+
+// args: sections key [symbol], printed as icfdiff -q does
+int query(const std::string &name, const std::vector<std::string> &args) {
+  const char *prefix = getenv("DISPLAY_PREFIX");
+  Reader r(name);
+  for (auto &sv : r.query(args[0], args[1], args.size() > 2 ? args[2] : "")) {
+    std::cout << (prefix ? prefix : "") << args[0] << "  " << sv.first << "  "
+              << args[1] << '=' << sv.second << '\n';
+  }
+  return 0;
+}
+}
@@ -0,0 +1,51 @@
+#ifndef __ICF_IMAGE_HPP__
+#define __ICF_IMAGE_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "icf.hpp"
+
+// a loaded tree published to shared memory as a read-only, position
+// independent image, for many processes of a host to query without each
+// parsing it. /NAME holds the current generation and reader slots, /NAME.<gen>
+// each image; publish() swaps in a new one atomically and unlinks old ones
+// once no reader is in them, and readers never wait on a publisher
+namespace icfimage {
+struct Control;
+
+void publish(const Icf &icf, const std::string &name);
+
+class Reader {
+public:
+  explicit Reader(const std::string &name); // exits if nothing is published
+  ~Reader();
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+
+  // symbol -> value for (sections, key), or only for sym if given
+  std::map<std::string, std::string> query(const std::string &sections,
+                                           const std::string &key,
+                                           const std::string &sym = "");
+  std::vector<std::string> members(const std::string &group);
+  uint64_t generation() const { return mappedGen_; }
+
+private:
+  const char *enter(); // current image, safe to read until leave()
+  void leave();
+
+  std::string name_;
+  Control *ctl_ = NULL;
+  size_t slot_ = 0;
+  uint64_t mappedGen_ = 0;
+  const char *image_ = NULL;
+  size_t size_ = 0;
+};
+
+// icfdiff --publish and --image
+int publishFile(const std::string &name, const std::string &fname);
+int query(const std::string &name, const std::vector<std::string> &args);
+}
+
+#endif
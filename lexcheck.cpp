@@ -0,0 +1,194 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include "util.hpp"
+#include "icf.hpp"
+#include "lexer.hpp"
+#include "lexcheck.hpp"
+
+using namespace std;
+
+namespace {
+typedef sophoi::LexLine LexLine;
+
+// the getline + trim + split + find_first_of("=") path LineLexer replaces
+struct Lexed {
+  LexLine::Kind kind;
+  string text;
+  vector<string> fields;
+  vector<size_t> eqs;
+};
+
+void oldLex(const char *buf, size_t len, vector<Lexed> &out) {
+  out.clear();
+  size_t p = 0;
+  while (p < len) {
+    const char *nl = static_cast<const char *>(memchr(buf + p, '\n', len - p));
+    size_t e = nl ? nl - buf : len;
+    string line(buf + p, e - p);
+    p = e + 1;
+    Lexed l;
+    l.text = detail::trim(line, true);
+    if (l.text.empty()) {
+      l.kind = LexLine::BLANK;
+    } else if (l.text[0] == '#') {
+      l.kind = l.text.compare(0, 8, "#include") == 0
+                   ? LexLine::INCLUDE
+                   : l.text.compare(0, 9, "#groupdef") == 0
+                         ? LexLine::GROUPDEF
+                         : l.text.compare(0, 10, "#groupexpr") == 0
+                               ? LexLine::GROUPEXPR
+                               : l.text.compare(0, 10, "#groupfile") == 0
+                                     ? LexLine::GROUPFILE
+                                     : LexLine::ENDGROUPDEF;
+    } else {
+      l.kind = LexLine::BODY;
+      l.fields = sophoi::split(l.text);
+      for (auto &f : l.fields) {
+        l.eqs.push_back(f.find_first_of("="));
+      }
+    }
+    out.push_back(l);
+  }
+}
+
+size_t newLex(const char *buf, size_t len, sophoi::LineLexer::Isa isa) {
+  sophoi::LineLexer lexer(buf, len, isa);
+  LexLine lex;
+  size_t n = 0;
+  while (lexer.next(lex)) {
+    n += lex.fields.size();
+  }
+  return n;
+}
+
+bool same(const Lexed &o, const LexLine &n) {
+  if (o.kind != n.kind) {
+    return false;
+  }
+  if (o.kind == LexLine::BLANK) {
+    return true;
+  }
+  if (o.text != n.text() or o.fields.size() != n.fields.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < o.fields.size(); ++i) {
+    size_t eq = n.fields[i].eq == n.fields[i].len ? string::npos
+                                                  : n.fields[i].eq;
+    if (o.fields[i] != n.field(i) or o.eqs[i] != eq) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const sophoi::LineLexer::Isa ISAS[] = {sophoi::LineLexer::SCALAR,
+                                      sophoi::LineLexer::SSE42,
+                                      sophoi::LineLexer::AVX2};
+
+// lines of buf every isa the cpu has lexes otherwise than the getline path,
+// reported as from name; 0 or 1 per isa, each stops at its first
+int differ(const string &name, const char *buf, size_t len,
+           const vector<Lexed> &ref) {
+  int bad = 0;
+  for (auto isa : ISAS) {
+    if (isa > sophoi::LineLexer::best()) {
+      continue;
+    }
+    sophoi::LineLexer lexer(buf, len, isa);
+    LexLine lex;
+    size_t lineno = 0;
+    while (lexer.next(lex)) {
+      if (lineno >= ref.size() or not same(ref[lineno], lex)) {
+        cerr << "-- " << sophoi::LineLexer::name(isa) << " lexer differs at "
+             << name << ':' << lineno + 1 << ": " << lex.line() << endl;
+        bad++;
+        break;
+      }
+      lineno++;
+    }
+    if (lineno < ref.size() and bad == 0) {
+      cerr << "-- " << sophoi::LineLexer::name(isa) << " lexer stops early in "
+           << name << endl;
+      bad++;
+    }
+  }
+  return bad;
+}
+
+// pieces .icf lines are made of, with all the lexers treat specially
+const char *const PIECES[] = {
+    " ", "\t", "\r", "  ", "#", "//", "/", "=", "==", "a", "BRK-B", "k=v",
+    "key=", "=v", "(A+B)", "G^H", "#include", "#groupdef", "#endgroupdef",
+    "#groupexpr", "#groupfile", "x/y", "a#b", "v=1,2,3", "\xc3\xa9",
+    "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"};
+const size_t NPIECES = sizeof(PIECES) / sizeof(PIECES[0]);
+
+template <typename F> double seconds(unsigned reps, F f) {
+  auto t0 = chrono::steady_clock::now();
+  for (unsigned r = 0; r < reps; ++r) {
+    f();
+  }
+  return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+}
+
+namespace icflex {
+int check(const vector<string> &files) {
+  int bad = 0;
+  for (auto &fn : files) {
+    sophoi::MappedFile mf(fn);
+    if (not mf.ok()) {
+      cerr << "-- cannot read file: " << fn << endl;
+      return -1;
+    }
+    vector<Lexed> ref;
+    oldLex(mf.data(), mf.size(), ref);
+    bad += differ(fn, mf.data(), mf.size(), ref);
+
+    // enough repetitions for ~64MB of input per measurement
+    unsigned reps = mf.size() ? 1 + (64u << 20) / mf.size() : 1;
+    double mb = double(mf.size()) * reps / (1 << 20);
+    double t = seconds(reps, [&]() { oldLex(mf.data(), mf.size(), ref); });
+    printf("%-40s %8zu lines  %-8s %8.1f MB/s\n", fn.c_str(), ref.size(),
+           "getline", mb / t);
+    for (auto isa : ISAS) {
+      if (isa > sophoi::LineLexer::best()) {
+        continue;
+      }
+      t = seconds(reps, [&]() { newLex(mf.data(), mf.size(), isa); });
+      printf("%-40s %8zu lines  %-8s %8.1f MB/s\n", fn.c_str(), ref.size(),
+             sophoi::LineLexer::name(isa), mb / t);
+    }
+  }
+  return bad ? -1 : 0;
+}
+
+// random lines of PIECES in buffers of 1000, the last line of every other
+// one without its '\n', lexed both ways as check() does
+int fuzz(unsigned long lines, unsigned seed) {
+  mt19937 rng(seed);
+  vector<Lexed> ref;
+  int bad = 0;
+  for (unsigned long done = 0, buf = 0; done < lines and not bad; ++buf) {
+    string text;
+    for (unsigned i = 0; i < 1000 and done < lines; ++i, ++done) {
+      for (unsigned n = rng() % 16; n > 0; --n) {
+        text += PIECES[rng() % NPIECES];
+      }
+      text += '\n';
+    }
+    if (buf % 2) {
+      text.pop_back();
+    }
+    oldLex(text.data(), text.size(), ref);
+    bad += differ("fuzz buffer " + to_string(buf), text.data(), text.size(),
+                  ref);
+  }
+  printf("%lu fuzzed lines, seed %u: %s\n", lines, seed,
+         bad ? "lexers differ" : "same");
+  return bad ? -1 : 0;
+}
+}
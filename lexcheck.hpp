@@ -0,0 +1,15 @@
+#ifndef __ICF_LEXCHECK_HPP__
+#define __ICF_LEXCHECK_HPP__
+
+#include <string>
+#include <vector>
+
+namespace icflex {
+// check LineLexer gives the same lines as getline + trim + split for every
+// isa the cpu has, and time each against the getline path
+int check(const std::vector<std::string> &files);
+// the same check over lines made at random from seed
+int fuzz(unsigned long lines, unsigned seed);
+}
+
+#endif
@@ -0,0 +1,270 @@
+#include <string.h>
+#include <stdlib.h>
+#include "lexer.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ICF_LEXER_X86
+#endif
+
+namespace {
+using sophoi::LineLexer;
+typedef LineLexer::Block Block;
+
+const size_t NPOS = std::string::npos;
+const size_t WINDOW = 1024; // blocks classified at a time, 64KB of input
+
+void classifyScalar(const char *p, size_t n, Block &b) {
+  b = Block();
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t bit = 1ULL << i;
+    switch (p[i]) {
+    case '\n': b.nl |= bit; break;
+    case ' ': b.sp |= bit; b.ws |= bit; break;
+    case '\t': case '\r': b.ws |= bit; break;
+    case '#': b.hash |= bit; break;
+    case '/': b.slash |= bit; break;
+    case '=': b.eq |= bit; break;
+    }
+  }
+}
+
+#ifdef ICF_LEXER_X86
+__attribute__((target("sse4.2"))) void classifySse42(const char *p,
+                                                     Block &b) {
+  const __m128i wsset = _mm_setr_epi8(' ', '\t', '\r', 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0);
+  const __m128i nl = _mm_set1_epi8('\n'), sp = _mm_set1_epi8(' '),
+                hash = _mm_set1_epi8('#'), slash = _mm_set1_epi8('/'),
+                eq = _mm_set1_epi8('=');
+  b = Block();
+  for (int i = 0; i < 4; ++i) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+    int sh = 16 * i;
+    __m128i ws = _mm_cmpestrm(wsset, 3, v, 16,
+                              _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                  _SIDD_UNIT_MASK);
+    b.ws |= uint64_t(uint16_t(_mm_movemask_epi8(ws))) << sh;
+    b.nl |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)))) << sh;
+    b.sp |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)))) << sh;
+    b.hash |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, hash))))
+              << sh;
+    b.slash |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash))))
+               << sh;
+    b.eq |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, eq)))) << sh;
+  }
+}
+
+__attribute__((target("avx2"))) uint64_t mask64(__m256i lo, __m256i hi,
+                                                __m256i c) {
+  return uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, c)))) |
+         uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, c))))
+             << 32;
+}
+
+__attribute__((target("avx2"))) void classifyAvx2(const char *p, Block &b) {
+  __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+  b.nl = mask64(lo, hi, _mm256_set1_epi8('\n'));
+  b.sp = mask64(lo, hi, _mm256_set1_epi8(' '));
+  b.ws = b.sp | mask64(lo, hi, _mm256_set1_epi8('\t')) |
+         mask64(lo, hi, _mm256_set1_epi8('\r'));
+  b.hash = mask64(lo, hi, _mm256_set1_epi8('#'));
+  b.slash = mask64(lo, hi, _mm256_set1_epi8('/'));
+  b.eq = mask64(lo, hi, _mm256_set1_epi8('='));
+}
+#endif
+
+// bits [from, to) of block idx, positions relative to buffer
+uint64_t rangeMask(size_t idx, size_t from, size_t to) {
+  size_t lo = idx * 64, hi = lo + 64;
+  uint64_t m = ~0ULL;
+  if (from > lo) {
+    m &= ~0ULL << (from - lo);
+  }
+  if (to < hi) {
+    m &= (to - lo) == 0 ? 0 : ~0ULL >> (64 - (to - lo));
+  }
+  return m;
+}
+
+struct Directive {
+  const char *text;
+  size_t len;
+  sophoi::LexLine::Kind kind;
+};
+const Directive DIRECTIVES[] = {
+    {"#include", 8, sophoi::LexLine::INCLUDE},
+    {"#groupdef", 9, sophoi::LexLine::GROUPDEF},
+    {"#endgroupdef", 12, sophoi::LexLine::ENDGROUPDEF},
+    {"#groupexpr", 10, sophoi::LexLine::GROUPEXPR},
+    {"#groupfile", 10, sophoi::LexLine::GROUPFILE}};
+}
+
+namespace sophoi {
+LineLexer::Isa LineLexer::best() {
+  Isa isa = SCALAR;
+#ifdef ICF_LEXER_X86
+  if (__builtin_cpu_supports("avx2")) {
+    isa = AVX2;
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    isa = SSE42;
+  }
+#endif
+  const char *env = getenv("LEXER"); // scalar, sse42 or avx2
+  if (env) {
+    Isa cap = strcmp(env, "scalar") == 0 ? SCALAR
+                                         : strcmp(env, "sse42") == 0 ? SSE42
+                                                                     : AVX2;
+    if (cap < isa) {
+      isa = cap;
+    }
+  }
+  return isa;
+}
+
+const char *LineLexer::name(Isa isa) {
+  return isa == AVX2 ? "avx2" : isa == SSE42 ? "sse42" : "scalar";
+}
+
+LineLexer::LineLexer(const char *buf, size_t len, Isa isa)
+    : buf_(buf), len_(len), isa_(isa) {}
+
+const LineLexer::Block &LineLexer::block(size_t idx) {
+  if (idx < first_ or idx >= first_ + blocks_.size()) {
+    // window restarts at the current line so its blocks all stay around
+    size_t from = pos_ / 64;
+    size_t n = idx + 1 - from < WINDOW ? WINDOW : idx + 1 - from;
+    size_t nblocks = (len_ + 63) / 64;
+    if (from + n > nblocks) {
+      n = nblocks - from;
+    }
+    first_ = from;
+    blocks_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      size_t off = (from + i) * 64;
+      const char *p = buf_ + off;
+      char tail[64];
+      if (off + 64 > len_) { // never read past the buffer
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p, len_ - off);
+        p = tail;
+      }
+#ifdef ICF_LEXER_X86
+      if (isa_ == AVX2) {
+        classifyAvx2(p, blocks_[i]);
+        continue;
+      } else if (isa_ == SSE42) {
+        classifySse42(p, blocks_[i]);
+        continue;
+      }
+#endif
+      classifyScalar(p, 64, blocks_[i]);
+    }
+  }
+  return blocks_[idx - first_];
+}
+
+size_t LineLexer::firstSet(uint64_t Block::*cls, size_t from, size_t to) {
+  for (size_t idx = from / 64; from < to and idx * 64 < to; ++idx) {
+    uint64_t m = block(idx).*cls & rangeMask(idx, from, to);
+    if (m) {
+      return idx * 64 + __builtin_ctzll(m);
+    }
+  }
+  return NPOS;
+}
+
+size_t LineLexer::firstClear(uint64_t Block::*cls, size_t from, size_t to) {
+  for (size_t idx = from / 64; from < to and idx * 64 < to; ++idx) {
+    uint64_t m = ~(block(idx).*cls) & rangeMask(idx, from, to);
+    if (m) {
+      return idx * 64 + __builtin_ctzll(m);
+    }
+  }
+  return NPOS;
+}
+
+size_t LineLexer::lastClear(uint64_t Block::*cls, size_t from, size_t to) {
+  if (from >= to) {
+    return NPOS;
+  }
+  for (size_t idx = (to - 1) / 64; idx + 1 > from / 64; --idx) {
+    uint64_t m = ~(block(idx).*cls) & rangeMask(idx, from, to);
+    if (m) {
+      return idx * 64 + 63 - __builtin_clzll(m);
+    }
+    if (idx == 0) {
+      break;
+    }
+  }
+  return NPOS;
+}
+
+bool LineLexer::next(LexLine &line) {
+  if (pos_ >= len_) {
+    return false;
+  }
+  size_t s = pos_;
+  size_t e = firstSet(&Block::nl, s, len_);
+  if (e == NPOS) {
+    e = len_;
+  }
+  line.raw = buf_ + s;
+  line.rawLen = e - s;
+  line.kind = LexLine::BLANK;
+  line.fields.clear();
+  const char *l = line.raw;
+  size_t len = line.rawLen;
+
+  // same steps, and quirks, as detail::trim(line, true), relative to s
+  size_t start = firstClear(&Block::ws, s, e);
+  if (start != NPOS) {
+    start -= s;
+    for (auto &d : DIRECTIVES) {
+      if (len - start >= d.len and memcmp(l + start, d.text, d.len) == 0) {
+        line.kind = d.kind;
+        line.b = start;
+        line.e = len;
+        break;
+      }
+    }
+  }
+  if (line.kind == LexLine::BLANK and start != NPOS and l[start] != '#' and
+      not(l[start] == '/' and start + 1 < len and l[start + 1] == '/')) {
+    size_t stop = firstSet(&Block::hash, s, e);
+    size_t ss = firstSet(&Block::slash, s, e);
+    if (ss != NPOS and ss < stop) {
+      stop = ss;
+    }
+    if (stop != NPOS) {
+      stop = stop - s - 1; // wraps to NPOS at 0, as trim() does
+    }
+    size_t upto = stop == NPOS or stop >= len ? len : stop + 1;
+    stop = lastClear(&Block::ws, s, s + upto);
+    if (stop != NPOS) {
+      line.kind = LexLine::BODY;
+      line.b = start;
+      line.e = stop - s + 1;
+      // fields are runs of non ' ', as split() in awk mode gives
+      size_t p = s + line.b, te = s + line.e;
+      while (p < te) {
+        size_t fb = firstClear(&Block::sp, p, te);
+        if (fb == NPOS) {
+          break;
+        }
+        size_t fe = firstSet(&Block::sp, fb, te);
+        if (fe == NPOS) {
+          fe = te;
+        }
+        size_t eq = firstSet(&Block::eq, fb, fe);
+        LexField f = {uint32_t(fb - s), uint32_t(fe - fb),
+                      uint32_t(eq == NPOS ? fe - fb : eq - fb)};
+        line.fields.push_back(f);
+        p = fe;
+      }
+    }
+  }
+  pos_ = e + 1;
+  return true;
+}
+}
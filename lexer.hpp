@@ -0,0 +1,67 @@
+#ifndef __ICF_LEXER_HPP__
+#define __ICF_LEXER_HPP__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace sophoi {
+// one pass over a buffer of .icf lines: classifies each line and finds its
+// trimmed range, space separated fields and first '=' of each field exactly
+// as detail::trim(line, true), split() and find_first_of("=") would
+struct LexField {
+  uint32_t off, len; // relative to LexLine::raw
+  uint32_t eq;       // first '=' relative to field start, or len if none
+};
+
+struct LexLine {
+  enum Kind {
+    BLANK,
+    INCLUDE,
+    GROUPDEF,
+    ENDGROUPDEF,
+    GROUPEXPR,
+    GROUPFILE,
+    BODY
+  };
+  Kind kind;
+  const char *raw;  // line without '\n', as from getline()
+  uint32_t rawLen;
+  uint32_t b, e;    // trimmed text is raw[b, e); directives are not right trimmed
+  std::vector<LexField> fields; // BODY only
+  std::string text() const { return std::string(raw + b, e - b); }
+  std::string line() const { return std::string(raw, rawLen); }
+  std::string field(size_t i) const {
+    return std::string(raw + fields[i].off, fields[i].len);
+  }
+};
+
+class LineLexer {
+public:
+  enum Isa { SCALAR, SSE42, AVX2 };
+  static Isa best(); // widest the cpu supports, capped by env LEXER
+  static const char *name(Isa);
+
+  LineLexer(const char *buf, size_t len, Isa isa = best());
+  bool next(LexLine &line);
+
+  struct Block { // bit i set if byte 64 * block + i is of the class
+    uint64_t nl, ws, sp, hash, slash, eq;
+  };
+
+private:
+  const Block &block(size_t idx);
+  size_t firstSet(uint64_t Block::*cls, size_t from, size_t to);
+  size_t firstClear(uint64_t Block::*cls, size_t from, size_t to);
+  size_t lastClear(uint64_t Block::*cls, size_t from, size_t to);
+
+  const char *buf_;
+  size_t len_;
+  size_t pos_ = 0;
+  Isa isa_;
+  size_t first_ = 0; // index of blocks_[0]
+  std::vector<Block> blocks_;
+};
+}
+
+#endif
@@ -1,11 +1,15 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/param.h>
 #include <iostream>
 #include <assert.h>
 #include <libgen.h> // basename,dirname
 #include "util.hpp"
 #include "path.hpp"
+#include "trace.hpp"
+#include "archive.hpp"
 
 bool endsWith(std::string heystack, std::string straw) {
   auto hl = heystack.length();
@@ -30,6 +34,11 @@ bool endsWith(std::string heystack, std::string straw) {
  */
 PathFinder::PathFinder(std::string fname, const std::string &envstr) {
   //  std::cout << "--- PathFinder ctr(" << fname << ")\n";
+  std::string archive, member;
+  if (icfarc::Archive::split(fname, archive, member)) {
+    archive_.reset(new icfarc::Archive(archive));
+    fname = member; // extra ext is that of the member
+  }
   std::string env = envstr;
   std::string xls;
   if (env.empty()) {
@@ -50,17 +59,16 @@ PathFinder::PathFinder(std::string fname, const std::string &envstr) {
     auto pathparts = sophoi::split(ep, ":");
     //    std::cerr << pathparts.size() << pathparts[0] << "." << std::endl;
     if (pathparts.size() < 1) {
-      std::cerr << "-- bad CFGPATH=" << env.c_str() << " -- "
-                << pathparts.size() << " parts in '" << ep.c_str() << "'\n";
-      exit(-1);
+      error_ = "-- bad CFGPATH=" + env + " -- " +
+               std::to_string(pathparts.size()) + " parts in '" + ep + "'";
+      return;
     }
     if (pathparts.size() == 1) {
       auto p = pathparts[0];
       char *full = realpath(p.c_str(), pathbuf);
       if (full == NULL) {
-        std::cerr << "-- bad path in CFGPATH=" << env.c_str() << " -- " << p
-                  << '\n';
-        exit(-1);
+        error_ = "-- bad path in CFGPATH=" + env + " -- " + p;
+        return;
       }
       extPaths_["DEFAULT"].push_back(full);
     } else {
@@ -70,9 +78,8 @@ PathFinder::PathFinder(std::string fname, const std::string &envstr) {
       for (auto &p : pathparts) {
         char *full = realpath(p.c_str(), pathbuf);
         if (full == NULL) {
-          std::cerr << "-- bad path in CFGPATH=" << env.c_str() << " -- " << p
-                    << '\n';
-          exit(-1);
+          error_ = "-- bad path in CFGPATH=" + env + " -- " + p;
+          return;
         }
         for (auto &ext : exts) {
           assert(!ext.empty());
@@ -81,12 +88,10 @@ PathFinder::PathFinder(std::string fname, const std::string &envstr) {
       }
     }
   }
-  char *fullpath = realpath(fname.c_str(), pathbuf);
-  if (fullpath == NULL) {
-    std::cerr << "-- bad path to initialize PathFinder: " << fname << '\n';
-    exit(-1);
+  if (not archive_ and realpath(fname.c_str(), pathbuf) == NULL) {
+    error_ = "-- bad path to initialize PathFinder: " + fname;
+    return;
   }
-  fullpath[sizeof(pathbuf) - 1] = '\0';
   for (auto &ep : extPaths_) {
     if (endsWith(fname, ep.first)) {
       extra_ = ep.first;
@@ -99,7 +104,11 @@ PathFinder::PathFinder(std::string fname, const std::string &envstr) {
     xlFiles_.insert(xp);
   }
   // XXX basename
-  cwd_ = getcwd(pathbuf, sizeof(pathbuf));
+  if (getcwd(pathbuf, sizeof(pathbuf)) == NULL) {
+    error_ = "-- cannot get current dir: " + std::string(strerror(errno));
+    return;
+  }
+  cwd_ = pathbuf;
 }
 
 bool PathFinder::ignore(std::string fname) {
@@ -116,9 +125,24 @@ bool PathFinder::ignore(std::string fname) {
 }
 
 std::string PathFinder::locate(std::string fname) {
+  auto found = search(fname);
+  ICF_TRACE2(locate, fname.c_str(), found.c_str());
+  return found;
+}
+
+std::string PathFinder::search(const std::string &fname) {
   if (fname.empty()) {
     return fname;
   }
+  if (archive_) { // members first, then the disk as usual
+    std::string archive, member = fname;
+    icfarc::Archive::split(fname, archive, member); // the root names it
+    const char *data;
+    size_t size;
+    if (archive_->find(member, data, size)) {
+      return archive_->path() + ':' + icfarc::Archive::normalize(member);
+    }
+  }
   char pathbuf[MAXPATHLEN];
   char *fullpath = realpath(fname.c_str(), pathbuf);
   if (fullpath != NULL) {
@@ -165,3 +189,14 @@ std::string PathFinder::locate(std::string fname) {
   }
   return fname;
 }
+
+const icfarc::Archive *PathFinder::archiveOf(const std::string &located,
+                                             std::string &member) const {
+  if (not archive_ or located.size() <= archive_->path().size() or
+      located.compare(0, archive_->path().size(), archive_->path()) != 0 or
+      located[archive_->path().size()] != ':') {
+    return NULL;
+  }
+  member = located.substr(archive_->path().size() + 1);
+  return archive_.get();
+}
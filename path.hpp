@@ -5,6 +5,11 @@
 #include <vector>
 #include <map>
 #include <unordered_set>
+#include <memory>
+
+namespace icfarc {
+class Archive;
+}
 
 class PathFinder
 {
@@ -13,10 +18,18 @@ class PathFinder
   std::string cwd_;
   std::map<std::string, std::vector<std::string>> extPaths_;
   std::unordered_set<std::string> xlFiles_;
+  std::shared_ptr<icfarc::Archive> archive_; // of an "archive:member" root
+  std::string error_;
+  std::string search(const std::string &fname);
 public:
   PathFinder(std::string path, const std::string& env = "");
+  // why path or CFGPATH is bad, for the caller to report; empty if fine
+  const std::string &error() const { return error_; }
   std::string locate(std::string fname);
   bool ignore(std::string fname);
+  // archive a located file is a member of, or NULL if it is on disk
+  const icfarc::Archive *archiveOf(const std::string &located,
+                                   std::string &member) const;
 };
 
 #endif
@@ -0,0 +1,343 @@
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "path.hpp"
+#include "prefetch.hpp"
+
+using namespace std;
+
+namespace {
+const unsigned ENTRIES = 64;         // reads in flight at once
+const size_t BUFFER_CAP = 256 << 20; // read ahead into memory, beyond it
+                                     // only into the page cache
+const size_t MAX_READ = 1 << 30;     // by one sqe, longer reads are split
+const char INCLUDE[] = "#include";
+
+// same test as the line lexer: only ' ', '\t' and '\r' before the directive
+bool lineStart(const char *data, const char *at) {
+  for (; at > data and at[-1] != '\n'; --at) {
+    if (at[-1] != ' ' and at[-1] != '\t' and at[-1] != '\r') {
+      return false;
+    }
+  }
+  return true;
+}
+}
+
+namespace icfio {
+// one io_uring set up by hand, as liburing may not be installed; only this
+// thread submits and reaps, so the barriers needed are those on the indexes
+// the kernel shares
+struct Prefetcher::Ring {
+  int fd = -1;
+  void *sq = MAP_FAILED, *cq = MAP_FAILED, *sqesMap = MAP_FAILED;
+  size_t sqLen = 0, cqLen = 0, sqesLen = 0;
+  unsigned *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  unsigned entries = 0, unsubmitted = 0;
+
+  bool open(unsigned n) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, n, &p);
+    if (fd < 0) { // ENOSYS, or EPERM where it is disabled
+      return false;
+    }
+    entries = p.sq_entries;
+    sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      sqLen = cqLen = max(sqLen, cqLen);
+    }
+    sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+      return false;
+    }
+    cq = single ? sq : mmap(NULL, cqLen, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+    sqesMap = mmap(NULL, sqesLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (cq == MAP_FAILED or sqesMap == MAP_FAILED) {
+      return false;
+    }
+    char *s = static_cast<char *>(sq), *c = static_cast<char *>(cq);
+    sqTail = reinterpret_cast<unsigned *>(s + p.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned *>(s + p.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned *>(s + p.sq_off.array);
+    cqHead = reinterpret_cast<unsigned *>(c + p.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *>(c + p.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned *>(c + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(c + p.cq_off.cqes);
+    sqes = static_cast<io_uring_sqe *>(sqesMap);
+    return true;
+  }
+  ~Ring() {
+    if (sqesMap != MAP_FAILED) {
+      munmap(sqesMap, sqesLen);
+    }
+    if (cq != MAP_FAILED and cq != sq) {
+      munmap(cq, cqLen);
+    }
+    if (sq != MAP_FAILED) {
+      munmap(sq, sqLen);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  void read(int rfd, char *buf, size_t len, size_t off, void *tag) {
+    unsigned tail = *sqTail; // only we write it
+    unsigned idx = tail & *sqMask;
+    io_uring_sqe &e = sqes[idx];
+    memset(&e, 0, sizeof(e));
+    e.opcode = IORING_OP_READ;
+    e.fd = rfd;
+    e.addr = reinterpret_cast<uint64_t>(buf);
+    e.len = min(len, MAX_READ);
+    e.off = off;
+    e.user_data = reinterpret_cast<uint64_t>(tag);
+    sqArray[idx] = idx;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+  }
+  // submit what was queued, and wait for a completion if asked
+  void enter(bool wait) {
+    while (unsubmitted or wait) {
+      int n = syscall(__NR_io_uring_enter, fd, unsubmitted, wait ? 1 : 0,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // reads in flight still write to our buffers: nothing safe to do
+        cerr << "-- io_uring_enter failed: " << strerror(errno) << '\n';
+        exit(-1);
+      }
+      unsubmitted -= n;
+      wait = false;
+    }
+  }
+};
+
+Prefetcher::Prefetcher() {
+  ring_ = new Ring();
+  if (not ring_->open(ENTRIES)) {
+    delete ring_;
+    ring_ = NULL;
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    for (auto r : queued_) {
+      finish(*r, false);
+    }
+    queued_.clear();
+    while (inflight_ > 0) {
+      reap(true);
+    }
+    stop_ = true;
+  }
+  wake_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  delete ring_;
+}
+
+void Prefetcher::scan(const string &fname, const char *data, size_t len,
+                      PathFinder &pf) {
+  lock_guard<mutex> lock(mutex_);
+  pf_ = &pf;
+  includes(fname, data, len);
+  if (ring_) {
+    ring_->enter(false);
+  }
+}
+
+// with mutex_ held
+void Prefetcher::includes(const string &fname, const char *data, size_t len) {
+  const size_t n = sizeof(INCLUDE) - 1;
+  vector<string> names;
+  const char *p = data, *end = data + len;
+  while (const char *hit =
+             static_cast<const char *>(memmem(p, end - p, INCLUDE, n))) {
+    const char *eol = static_cast<const char *>(memchr(hit, '\n', end - hit));
+    eol = eol ? eol : end;
+    p = eol;
+    if (not lineStart(data, hit) or eol - hit <= long(n + 1)) {
+      continue;
+    }
+    // what follows the char after #include, trimmed, as Icf() takes it
+    string inc(hit + n + 1, eol);
+    size_t b = inc.find_first_not_of(" \t\n\r");
+    if (b == string::npos) {
+      continue;
+    }
+    names.push_back(inc.substr(b, inc.find_last_not_of(" \t\n\r") + 1 - b));
+  }
+  for (auto &name : names) {
+    if (not pf_->ignore(name)) {
+      start(pf_->locate(name), fname);
+    }
+  }
+}
+
+void Prefetcher::start(const string &fname, const string &parent) {
+  if (not started_.insert(fname).second) {
+    return;
+  }
+  int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return; // Icf() reports it
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 or not S_ISREG(st.st_mode) or st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+  if (not ring_ or buffered_ + size > BUFFER_CAP) {
+    close(fd);
+    ahead_.push_back(fname);
+    if (not thread_.joinable()) {
+      thread_ = thread(&Prefetcher::readahead, this);
+    }
+    wake_.notify_one();
+    return;
+  }
+  auto ins = reads_.emplace(fname, Read());
+  Read &r = ins.first->second;
+  r.name = &ins.first->first;
+  r.fd = fd;
+  r.buf.resize(size);
+  r.done = 0;
+  r.state = Read::PENDING;
+  r.parent = parent;
+  r.dropped = false;
+  buffered_ += size;
+  if (inflight_ < ring_->entries) {
+    submit(r);
+  } else {
+    queued_.push_back(&r);
+  }
+}
+
+void Prefetcher::submit(Read &r) {
+  ring_->read(r.fd, &r.buf[r.done], r.buf.size() - r.done, r.done, &r);
+  inflight_++;
+}
+
+void Prefetcher::reap(bool wait) {
+  ring_->enter(wait);
+  unsigned head = *ring_->cqHead; // only we write it
+  unsigned tail = __atomic_load_n(ring_->cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const io_uring_cqe &c = ring_->cqes[head & *ring_->cqMask];
+    Read &r = *reinterpret_cast<Read *>(c.user_data);
+    inflight_--;
+    if (c.res < 0) {
+      finish(r, false);
+    } else if (c.res == 0) { // shrank since fstat
+      buffered_ -= r.buf.size() - r.done;
+      r.buf.resize(r.done);
+      finish(r, true);
+    } else if ((r.done += c.res) < r.buf.size()) {
+      submit(r); // short read
+    } else {
+      finish(r, true);
+    }
+  }
+  __atomic_store_n(ring_->cqHead, head, __ATOMIC_RELEASE);
+  while (not queued_.empty() and inflight_ < ring_->entries) {
+    submit(*queued_.front());
+    queued_.pop_front();
+  }
+  ring_->enter(false);
+}
+
+void Prefetcher::finish(Read &r, bool ok) {
+  close(r.fd);
+  r.fd = -1;
+  ok = ok and not r.dropped;
+  r.state = ok ? Read::READY : Read::FAILED;
+  if (not ok) {
+    buffered_ -= r.buf.size();
+    string().swap(r.buf);
+    return;
+  }
+  // its includes are read while the parser is still on its parent
+  includes(*r.name, r.buf.data(), r.buf.size());
+}
+
+bool Prefetcher::take(const string &fname, string &data) {
+  lock_guard<mutex> lock(mutex_);
+  auto ritr = reads_.find(fname);
+  if (ritr == reads_.end()) {
+    return false;
+  }
+  Read &r = ritr->second;
+  while (r.state == Read::PENDING) {
+    reap(true);
+  }
+  bool ok = r.state == Read::READY;
+  if (ok) {
+    buffered_ -= r.buf.size();
+    data.swap(r.buf);
+  }
+  reads_.erase(ritr);
+  return ok;
+}
+
+void Prefetcher::parsed(const string &fname) {
+  lock_guard<mutex> lock(mutex_);
+  for (auto itr = begin(reads_); itr != end(reads_);) {
+    Read &r = itr->second;
+    if (r.parent != fname) {
+      ++itr;
+    } else if (r.state == Read::PENDING) { // its buffer goes when it lands
+      r.dropped = true;
+      ++itr;
+    } else {
+      buffered_ -= r.buf.size();
+      itr = reads_.erase(itr);
+    }
+  }
+}
+
+void Prefetcher::readahead() {
+  unique_lock<mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this]() { return stop_ or not ahead_.empty(); });
+    if (stop_) {
+      return;
+    }
+    string fname = ahead_.front();
+    ahead_.pop_front();
+    lock.unlock();
+    int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      struct stat st;
+      if (fstat(fd, &st) == 0) {
+        ::readahead(fd, 0, st.st_size); // blocks here, not in the parser
+      }
+      close(fd);
+    }
+    lock.lock();
+  }
+}
+}
@@ -0,0 +1,75 @@
+#ifndef __ICF_PREFETCH_HPP__
+#define __ICF_PREFETCH_HPP__
+
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+
+class PathFinder;
+
+// reads the files a .icf includes while its parent is still being parsed, so a
+// cold tree costs one round of concurrent reads per include level instead of
+// one blocking open and read per file. reads go through io_uring into buffers
+// handed to the parser, each scanned for its own includes as it completes so
+// the reads run ahead of the parser down the tree; without io_uring (or past
+// the memory cap) a thread asks the kernel to readahead() the files into the
+// page cache instead
+namespace icfio {
+class Prefetcher {
+public:
+  Prefetcher();
+  ~Prefetcher();
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  // resolve the #include lines of a file just read and start reading them
+  void scan(const std::string &fname, const char *data, size_t len,
+            PathFinder &pf);
+  // contents of a located file if it was read ahead, waiting for the read
+  // if still in flight; false means read it as usual
+  bool take(const std::string &fname, std::string &data);
+  // fname is parsed: what was read for its includes and not taken never
+  // will be, so it goes
+  void parsed(const std::string &fname);
+
+private:
+  struct Read {
+    int fd;
+    std::string buf;
+    size_t done;
+    enum { PENDING, READY, FAILED } state;
+    const std::string *name; // its key in reads_
+    std::string parent;      // whose include it is
+    bool dropped;       // parent parsed while in flight
+  };
+  struct Ring;
+
+  void includes(const std::string &fname, const char *data, size_t len);
+  void start(const std::string &fname, const std::string &parent);
+  void submit(Read &r);
+  void reap(bool wait);
+  void finish(Read &r, bool ok);
+  void readahead(); // fallback thread
+
+  std::mutex mutex_;
+  Ring *ring_ = NULL;
+  PathFinder *pf_ = NULL;
+  std::map<std::string, Read> reads_; // by located path
+  std::set<std::string> started_;     // each read ahead once, taken once
+  std::deque<Read *> queued_;         // waiting for a free ring entry
+  unsigned inflight_ = 0;
+  size_t buffered_ = 0; // bytes held for the parser, up to BUFFER_CAP
+
+  std::deque<std::string> ahead_; // for the readahead thread
+  std::condition_variable wake_;
+  std::thread thread_;
+  bool stop_ = false;
+};
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <malloc.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include "icf.hpp"
+#include "profile.hpp"
+
+using namespace std;
+
+namespace {
+const size_t NONE = size_t(-1);
+
+long long now() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// mallinfo2() is glibc 2.33 on; mallinfo() before it wraps past 2GB, and
+// other libcs have neither, so heap reads 0 there
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 33)
+#define ICF_MALLINFO mallinfo2
+#else
+#define ICF_MALLINFO mallinfo
+#endif
+#endif
+
+long long heap() {
+#ifdef ICF_MALLINFO
+  struct ICF_MALLINFO mi = ICF_MALLINFO();
+  return (long long)mi.uordblks + mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+void row(const icfprof::Cost &total, const icfprof::Cost &self,
+         const string &what) {
+  printf("%9.1f %9.1f %10lld %10lld %10lld %10lld %10lld  %s\n",
+         total.ns / 1e6, self.ns / 1e6, total.lines, self.lines, total.records,
+         self.records, total.heap >> 10, what.c_str());
+}
+}
+
+namespace icfprof {
+void Profile::enter(const string &fname) {
+  Node n;
+  n.file = fname;
+  n.parent = open_.empty() ? NONE : open_.back();
+  nodes_.push_back(n);
+  open_.push_back(nodes_.size() - 1);
+  Cost s;
+  s.heap = heap();
+  s.ns = now();
+  start_.push_back(s);
+}
+
+// children have left already, their totals taken off this one's own
+void Profile::leave(unsigned lines, size_t records) {
+  long long t = now();
+  Node &n = nodes_[open_.back()];
+  Cost &s = start_.back();
+  n.total.ns = t - s.ns;
+  n.total.heap = heap() - s.heap;
+  n.total.lines += lines;
+  n.total.records += records;
+  n.self.ns += n.total.ns;
+  n.self.heap += n.total.heap;
+  n.self.lines = lines;
+  n.self.records = records;
+  if (n.parent != NONE) {
+    Node &p = nodes_[n.parent];
+    p.self.ns -= n.total.ns;
+    p.self.heap -= n.total.heap;
+    p.total.lines += n.total.lines;
+    p.total.records += n.total.records;
+  }
+  open_.pop_back();
+  start_.pop_back();
+}
+
+void Profile::report() const {
+  const char *head = "%9s %9s %10s %10s %10s %10s %10s  %s\n";
+  printf(head, "ms", "own ms", "lines", "own lines", "records", "own recs",
+         "heap KB", "include node (in parent)");
+  vector<size_t> order(nodes_.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  stable_sort(begin(order), end(order), [this](size_t a, size_t b) {
+    return nodes_[a].total.ns > nodes_[b].total.ns;
+  });
+  for (auto i : order) {
+    auto &n = nodes_[i];
+    row(n.total, n.self, n.parent == NONE
+                             ? n.file
+                             : n.file + " (" + nodes_[n.parent].file + ')');
+  }
+
+  // a file included from many places costs its own share at each of them
+  struct File {
+    Cost total, self;
+    unsigned times = 0;
+  };
+  map<string, File> files;
+  for (auto &n : nodes_) {
+    auto &f = files[n.file];
+    f.times++;
+    f.self.ns += n.self.ns;
+    f.self.lines += n.self.lines;
+    f.self.records += n.self.records;
+    f.self.heap += n.self.heap;
+    f.total.ns += n.total.ns;
+    f.total.lines += n.total.lines;
+    f.total.records += n.total.records;
+    f.total.heap += n.total.heap;
+  }
+  vector<pair<string, File>> byOwn(begin(files), end(files));
+  stable_sort(begin(byOwn), end(byOwn),
+              [](const pair<string, File> &a, const pair<string, File> &b) {
+                return a.second.self.ns > b.second.self.ns;
+              });
+  printf("\n");
+  printf(head, "ms", "own ms", "lines", "own lines", "records", "own recs",
+         "heap KB", "file (times included)");
+  for (auto &f : byOwn) {
+    row(f.second.total, f.second.self,
+        f.first + " (" + to_string(f.second.times) + ')');
+  }
+}
+
+void Profile::folded() const {
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    long long us = nodes_[i].self.ns / 1000;
+    if (us <= 0) {
+      continue;
+    }
+    string stack = nodes_[i].file;
+    for (size_t p = nodes_[i].parent; p != NONE; p = nodes_[p].parent) {
+      stack = nodes_[p].file + ';' + stack;
+    }
+    printf("%s %lld\n", stack.c_str(), us);
+  }
+}
+
+int run(const string &fname, bool folded) {
+  shared_ptr<Icf::Options> opts(new Icf::Options());
+  opts->profile.reset(new Profile());
+  Icf icf(fname.c_str(), set<string>(), NULL, opts);
+  if (folded) {
+    opts->profile->folded();
+  } else {
+    opts->profile->report();
+  }
+  return 0;
+}
+}
@@ -0,0 +1,42 @@
+#ifndef __ICF_PROFILE_HPP__
+#define __ICF_PROFILE_HPP__
+
+#include <string>
+#include <vector>
+
+// what each node of an include tree costs to parse, on its own and with the
+// files it includes, to pick EXCLUDEs and spot costly files included often;
+// filled by Icf() when Options::profile is set
+namespace icfprof {
+struct Cost {
+  long long ns = 0;    // wall time
+  long long lines = 0; // read, blank ones too
+  long long records = 0;
+  long long heap = 0;  // bytes allocated and not freed yet, may be < 0
+};
+
+class Profile {
+public:
+  void enter(const std::string &fname);
+  void leave(unsigned lines, size_t records);
+  // nodes by time with children, then files by own time over every include
+  void report() const;
+  // parent;child;... own microseconds, for flamegraph.pl
+  void folded() const;
+
+private:
+  struct Node {
+    std::string file;
+    size_t parent; // npos for the root
+    Cost self, total;
+  };
+  std::vector<Node> nodes_;
+  std::vector<size_t> open_; // nodes being parsed, innermost last
+  std::vector<Cost> start_;  // clocks as each of them was entered
+};
+
+// icfdiff --profile
+int run(const std::string &fname, bool folded);
+}
+
+#endif
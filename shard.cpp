@@ -0,0 +1,115 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <stdlib.h>
+#include "util.hpp"
+#include "icf.hpp"
+#include "shard.hpp"
+
+using namespace std;
+
+namespace {
+const string MAGIC = "#icfdiff-shard";
+const string PART = "#part";
+
+bool parseSpec(const string &spec, unsigned &shard, unsigned &shards) {
+  auto parts = sophoi::split(spec, "/");
+  if (parts.size() != 2) {
+    return false;
+  }
+  char *e1, *e2;
+  shard = strtoul(parts[0].c_str(), &e1, 10);
+  shards = strtoul(parts[1].c_str(), &e2, 10);
+  return *e1 == '\0' and *e2 == '\0' and shards > 0 and shard < shards;
+}
+}
+
+namespace icfshard {
+// partial output: "#icfdiff-shard i/N validate|diff", then a "#part" line
+// before the dump of each Icf a full run would print
+int run(const string &spec, bool bySymbol, const vector<string> &files) {
+  shared_ptr<Icf::Options> opts(new Icf::Options());
+  if (not parseSpec(spec, opts->shard, opts->shards)) {
+    cerr << "-- bad shard spec '" << spec << "', expecting i/N" << endl;
+    exit(-1);
+  }
+  opts->shardBySymbol = bySymbol;
+  if (files.size() == 1) {
+    Icf icf(files[0].c_str(), set<string>(), NULL, opts);
+    cout << MAGIC << ' ' << spec << " validate\n" << PART << '\n';
+    icf.dump_to(cout);
+  } else {
+    Icf old(files[0].c_str(), set<string>(), NULL, opts);
+    Icf neu(files[1].c_str(), set<string>(), NULL, opts);
+    cout << MAGIC << ' ' << spec << " diff\n" << PART << '\n';
+    old.diff(neu).dump_to(cout);
+    cout << PART << '\n';
+    neu.diff(old, true).dump_to(cout);
+  }
+  return 0;
+}
+
+int merge(const vector<string> &partials) {
+  string mode;
+  unsigned shards = 0;
+  vector<bool> seen;
+  vector<vector<string>> parts; // part -> dump text of each shard
+  for (auto &fn : partials) {
+    ifstream in(fn);
+    string line;
+    if (in.fail() or not getline(in, line)) {
+      cerr << "-- cannot read partial output: " << fn << endl;
+      exit(-1);
+    }
+    auto hdr = sophoi::split(line);
+    unsigned shard, n;
+    if (hdr.size() != 3 or hdr[0] != MAGIC or not parseSpec(hdr[1], shard, n)) {
+      cerr << "-- not a partial icfdiff output: " << fn << endl;
+      exit(-1);
+    }
+    if (mode.empty()) {
+      mode = hdr[2];
+      shards = n;
+      seen.resize(n);
+    }
+    if (mode != hdr[2] or shards != n or seen[shard]) {
+      cerr << "-- partial output " << fn << " (" << hdr[1] << ' ' << hdr[2]
+           << ") does not fit with others or is repeated" << endl;
+      exit(-1);
+    }
+    seen[shard] = true;
+    unsigned p = 0;
+    while (getline(in, line)) {
+      if (line == PART) {
+        if (parts.size() <= p) {
+          parts.resize(p + 1);
+        }
+        parts[p++].push_back(string());
+      } else if (p > 0) {
+        parts[p - 1].back() += line + '\n';
+      }
+    }
+  }
+  for (unsigned i = 0; i < shards; ++i) {
+    if (not seen[i]) {
+      cerr << "-- missing partial output of shard " << i << '/' << shards
+           << endl;
+      exit(-1);
+    }
+  }
+  for (auto &dumps : parts) {
+    vector<unique_ptr<istringstream>> ins;
+    vector<istream *> ptrs;
+    for (auto &d : dumps) {
+      ins.emplace_back(new istringstream(d));
+      ptrs.push_back(ins.back().get());
+    }
+    cout << Icf::undump(ptrs);
+  }
+  if (mode == "validate") {
+    cout << endl;
+  }
+  return 0;
+}
+}
@@ -0,0 +1,16 @@
+#ifndef __ICF_SHARD_HPP__
+#define __ICF_SHARD_HPP__
+
+#include <string>
+#include <vector>
+
+// spread a validate/diff over N runs, each keeping only keys whose section
+// header (or symbol) hashes to its shard; merge gives the single-run output
+namespace icfshard {
+// spec is "i/N"; writes partial output of shard i to stdout
+int run(const std::string &spec, bool bySymbol,
+        const std::vector<std::string> &files);
+int merge(const std::vector<std::string> &partials);
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include <iostream>
+#include <map>
+#include <stdlib.h>
+#include "util.hpp"
+#include "icf.hpp"
+#include "delta.hpp"
+#include "summary.hpp"
+
+using namespace std;
+
+namespace {
+struct Counts {
+  size_t changed = 0, added = 0, removed = 0;
+};
+
+// counts entries by section header, as one walk of each side would record
+// them, until more than max
+struct Counter : Icf::DiffVisitor {
+  Counter(size_t max) : max(max) {}
+  bool changed(const Icf::IcfKey &k, const string &, const string &,
+               Icf::Origin, Icf::Origin) {
+    at(k).changed++;
+    total.changed++;
+    return ++n <= max;
+  }
+  bool only(const Icf::IcfKey &k, const string &, const Icf::WithEnv &) {
+    if (reverse) {
+      at(k).added++;
+      total.added++;
+    } else {
+      at(k).removed++;
+      total.removed++;
+    }
+    return ++n <= max;
+  }
+  Counts &at(const Icf::IcfKey &k) {
+    return byHeader[k.first.substr(0, k.first.find(':'))];
+  }
+
+  size_t max, n = 0;
+  bool reverse = false;
+  map<string, Counts> byHeader;
+  Counts total;
+};
+
+void line(string &out, const string &name, const Counts &c, bool ndjson,
+          size_t width) {
+  if (ndjson) {
+    out += "{\"section\":" + sophoi::jsonQuote(name) + ",\"changed\":" +
+           to_string(c.changed) + ",\"added\":" + to_string(c.added) +
+           ",\"removed\":" + to_string(c.removed) + "}\n";
+    return;
+  }
+  out += name + string(width - name.size(), ' ') +
+         "  changed=" + to_string(c.changed) + " added=" + to_string(c.added) +
+         " removed=" + to_string(c.removed) + '\n';
+}
+}
+
+namespace icfsummary {
+int run(const string &oldf, const string &newf, size_t maxDiffs) {
+  Icf old = icfdelta::load(oldf), neu = icfdelta::load(newf);
+  Counter counter(maxDiffs);
+  bool whole = old.diffWalk(neu, false, counter);
+  counter.reverse = true;
+  whole = whole and neu.diffWalk(old, true, counter);
+
+  const char *prefix = getenv("DISPLAY_PREFIX");
+  const char *fmt = getenv("OUTPUT_FORMAT");
+  bool ndjson = fmt and string(fmt) == "ndjson";
+  size_t width = 5; // "total"
+  for (auto &hc : counter.byHeader) {
+    width = max(width, hc.first.size());
+  }
+  string out;
+  for (auto &hc : counter.byHeader) {
+    out += ndjson or not prefix ? "" : prefix;
+    line(out, hc.first, hc.second, ndjson, width);
+  }
+  if (ndjson) {
+    auto &t = counter.total;
+    out += "{\"total\":{\"changed\":" + to_string(t.changed) +
+           ",\"added\":" + to_string(t.added) +
+           ",\"removed\":" + to_string(t.removed) +
+           "},\"stopped\":" + (whole ? "false" : "true") + "}\n";
+  } else {
+    out += prefix ? prefix : "";
+    line(out, "total", counter.total, false, width);
+    if (not whole) {
+      out.back() = ' ';
+      out += " (stopped past --max-diffs " + to_string(maxDiffs) + ")\n";
+    }
+  }
+  cout << out;
+  return not whole ? 2 : counter.n > 0 ? 1 : 0;
+}
+}
@@ -0,0 +1,14 @@
+#ifndef __ICF_SUMMARY_HPP__
+#define __ICF_SUMMARY_HPP__
+
+#include <string>
+
+// counts of what a diff of two trees would print, per section header, taken
+// straight from the diff walk: no result tree, group naming or formatting
+namespace icfsummary {
+// writes the counts to stdout; returns 0 if the trees are the same, 1 if
+// they differ, 2 if more than maxDiffs entries do, which stops the walk
+int run(const std::string &oldf, const std::string &newf, size_t maxDiffs);
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include "util.hpp"
+#include "symlist.hpp"
+
+using namespace std;
+
+namespace {
+bool space(char c) { return c == ' ' or c == '\t' or c == '\r'; }
+}
+
+namespace icfsyms {
+bool scan(const char *data, size_t size,
+          const function<void(const char *, size_t)> &each, string &err) {
+  if (size >= sizeof(MAGIC) and memcmp(data, MAGIC, sizeof(MAGIC)) == 0) {
+    uint64_t count;
+    if (size < sizeof(MAGIC) + sizeof(count)) {
+      err = "truncated";
+      return false;
+    }
+    memcpy(&count, data + sizeof(MAGIC), sizeof(count));
+    size_t at = sizeof(MAGIC) + sizeof(count);
+    if (count >= (size - at) / sizeof(uint64_t)) {
+      err = "bad count";
+      return false;
+    }
+    const char *offs = data + at, *bytes = offs + (count + 1) * sizeof(uint64_t);
+    size_t avail = data + size - bytes;
+    uint64_t b, e;
+    memcpy(&b, offs, sizeof(b));
+    for (uint64_t i = 0; i < count; ++i, b = e) {
+      memcpy(&e, offs + (i + 1) * sizeof(e), sizeof(e));
+      if (e < b or e > avail) {
+        err = "bad offset of symbol " + to_string(i);
+        return false;
+      }
+      each(bytes + b, e - b);
+    }
+    return true;
+  }
+  for (size_t p = 0; p < size;) {
+    const char *nl = static_cast<const char *>(memchr(data + p, '\n', size - p));
+    size_t e = nl ? nl - data : size, b = p;
+    p = e + 1;
+    while (b < e and space(data[b])) {
+      b++;
+    }
+    while (e > b and space(data[e - 1])) {
+      e--;
+    }
+    if (b < e and data[b] != '#') {
+      each(data + b, e - b);
+    }
+  }
+  return true;
+}
+
+int write(const string &fname) {
+  sophoi::MappedFile mf(fname);
+  if (not mf.ok()) {
+    cerr << "-- cannot read file: " << fname << endl;
+    return -1;
+  }
+  vector<string> syms;
+  string err;
+  if (not scan(mf.data(), mf.size(),
+               [&](const char *s, size_t n) { syms.push_back(string(s, n)); },
+               err)) {
+    cerr << "-- bad symbol list " << fname << ": " << err << endl;
+    return -1;
+  }
+  sort(begin(syms), end(syms));
+  syms.erase(unique(begin(syms), end(syms)), end(syms));
+  string out(MAGIC, sizeof(MAGIC));
+  uint64_t v = syms.size();
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  v = 0;
+  for (auto &s : syms) {
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    v += s.size();
+  }
+  out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  for (auto &s : syms) {
+    out += s;
+  }
+  cout.write(out.data(), out.size());
+  return cout ? 0 : -1;
+}
+}
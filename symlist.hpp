@@ -0,0 +1,26 @@
+#ifndef __ICF_SYMLIST_HPP__
+#define __ICF_SYMLIST_HPP__
+
+#include <string>
+#include <functional>
+#include <stdint.h>
+
+// members of a group kept outside the .icf, for #groupfile NAME path: a text
+// file of one symbol per line, best sorted, or the binary list --symlist makes
+// of one: MAGIC, uint64_t count, count + 1 uint64_t offsets into the bytes that
+// follow them, symbol i being bytes[offsets[i], offsets[i + 1]); host order
+namespace icfsyms {
+const char MAGIC[8] = {'I', 'C', 'F', 'S', 'Y', 'M', 'S', '1'};
+
+// each symbol of a list in the order it is there, blank and # lines of a
+// text one skipped; false with err if a binary list is malformed
+bool scan(const char *data, size_t size,
+          const std::function<void(const char *, size_t)> &each,
+          std::string &err);
+
+// icfdiff --symlist: a text list, sorted and without duplicates, as a
+// binary list to stdout
+int write(const std::string &fname);
+}
+
+#endif
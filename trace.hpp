@@ -0,0 +1,79 @@
+#ifndef __ICF_TRACE_HPP__
+#define __ICF_TRACE_HPP__
+
+#include <stdint.h>
+
+// static tracepoints, usdt:icfdiff:NAME to perf and bpftrace, each a single
+// nop until a tracer attaches. with <sys/sdt.h> they are systemtap's; without
+// it, on x86-64, the same .note.stapsdt entries are written here; elsewhere,
+// or built with -DICF_NO_TRACE, they are nothing. arguments are integers or
+// char pointers and are evaluated attached or not, so keep them cheap
+#if !defined(ICF_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ICF_TRACE_SDT 1
+#endif
+#endif
+
+#if defined(ICF_TRACE_SDT)
+#define ICF_TRACE0(name) DTRACE_PROBE(icfdiff, name)
+#define ICF_TRACE1(name, a1) DTRACE_PROBE1(icfdiff, name, a1)
+#define ICF_TRACE2(name, a1, a2) DTRACE_PROBE2(icfdiff, name, a1, a2)
+#define ICF_TRACE3(name, a1, a2, a3) DTRACE_PROBE3(icfdiff, name, a1, a2, a3)
+#define ICF_TRACE4(name, a1, a2, a3, a4)                                       \
+  DTRACE_PROBE4(icfdiff, name, a1, a2, a3, a4)
+
+#elif defined(__x86_64__) && !defined(ICF_NO_TRACE)
+// a nop at the probe site, and a note saying where it is and which registers
+// hold the arguments, every one passed as a signed 8 byte integer
+#define ICF_TRACE_NOTE(name, args)                                             \
+  "990: nop\n"                                                                 \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+  ".balign 4\n"                                                                \
+  ".4byte 992f-991f,994f-993f,3\n"                                             \
+  "991: .asciz \"stapsdt\"\n"                                                  \
+  "992: .balign 4\n"                                                           \
+  "993: .8byte 990b\n"                                                         \
+  ".8byte _.stapsdt.base\n"                                                    \
+  ".8byte 0\n" /* no semaphore */                                              \
+  ".asciz \"icfdiff\"\n"                                                       \
+  ".asciz \"" #name "\"\n"                                                     \
+  ".asciz \"" args "\"\n"                                                      \
+  "994: .balign 4\n"                                                           \
+  ".popsection\n"                                                              \
+  ".ifndef _.stapsdt.base\n"                                                   \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+  ".weak _.stapsdt.base\n"                                                     \
+  ".hidden _.stapsdt.base\n"                                                   \
+  "_.stapsdt.base: .space 1\n"                                                 \
+  ".size _.stapsdt.base,1\n"                                                   \
+  ".popsection\n"                                                              \
+  ".endif\n"
+#define ICF_TRACE_ARG(a) "r"((int64_t)(a))
+#define ICF_TRACE0(name) __asm__ __volatile__(ICF_TRACE_NOTE(name, ""))
+#define ICF_TRACE1(name, a1)                                                   \
+  __asm__ __volatile__(ICF_TRACE_NOTE(name, "-8@%0") : : ICF_TRACE_ARG(a1))
+#define ICF_TRACE2(name, a1, a2)                                               \
+  __asm__ __volatile__(ICF_TRACE_NOTE(name, "-8@%0 -8@%1")                     \
+                       :                                                       \
+                       : ICF_TRACE_ARG(a1), ICF_TRACE_ARG(a2))
+#define ICF_TRACE3(name, a1, a2, a3)                                           \
+  __asm__ __volatile__(ICF_TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2")               \
+                       :                                                       \
+                       : ICF_TRACE_ARG(a1), ICF_TRACE_ARG(a2),                 \
+                         ICF_TRACE_ARG(a3))
+#define ICF_TRACE4(name, a1, a2, a3, a4)                                       \
+  __asm__ __volatile__(ICF_TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3")         \
+                       :                                                       \
+                       : ICF_TRACE_ARG(a1), ICF_TRACE_ARG(a2),                 \
+                         ICF_TRACE_ARG(a3), ICF_TRACE_ARG(a4))
+
+#else
+#define ICF_TRACE0(name)
+#define ICF_TRACE1(name, a1)
+#define ICF_TRACE2(name, a1, a2)
+#define ICF_TRACE3(name, a1, a2, a3)
+#define ICF_TRACE4(name, a1, a2, a3, a4)
+#endif
+
+#endif
@@ -1,3 +1,12 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <stdio.h>
 #include "util.hpp"
 
 using namespace std;
@@ -55,5 +64,94 @@ std::vector<std::string> split(const std::string &str,
                                const std::string &needles) {
   return tokenize(str, needles, 0, true);
 }
+
+void parallelFor(size_t n, const std::function<void(size_t)> &fn,
+                 const std::function<void(size_t)> &done) {
+  size_t nthreads = std::thread::hardware_concurrency();
+  if (nthreads > n) {
+    nthreads = n;
+  }
+  if (nthreads < 2) {
+    for (size_t i = 0; i < n; ++i) {
+      fn(i);
+      if (done) {
+        done(i);
+      }
+    }
+    return;
+  }
+  std::atomic<size_t> next(0);
+  std::vector<char> finished(n, 0);
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nthreads; ++t) {
+    threads.emplace_back([&]() {
+      for (size_t i = next++; i < n; i = next++) {
+        fn(i);
+        std::lock_guard<std::mutex> lock(mtx);
+        finished[i] = 1;
+        cv.notify_all();
+      }
+    });
+  }
+  if (done) {
+    for (size_t i = 0; i < n; ++i) {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return finished[i] != 0; });
+      }
+      done(i);
+    }
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+std::string jsonQuote(const std::string &str) {
+  std::string ret = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' or c == '\\') {
+      ret += '\\';
+      ret += c;
+    } else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      ret += esc;
+    } else {
+      ret += c;
+    }
+  }
+  return ret + '"';
+}
+
+MappedFile::MappedFile(const std::string &fname) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 and S_ISREG(st.st_mode)) {
+    size_ = st.st_size;
+    if (size_ == 0) {
+      data_ = "";
+      ok_ = true;
+    } else {
+      void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        madvise(p, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char *>(p);
+        ok_ = true;
+      }
+    }
+  }
+  close(fd);
 }
 
+MappedFile::~MappedFile() {
+  if (ok_ and size_ > 0) {
+    munmap(const_cast<char *>(data_), size_);
+  }
+}
+}
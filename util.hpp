@@ -3,11 +3,42 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 
 namespace sophoi {
 std::string trim(const std::string &line, bool sharpen = false);
 std::vector<std::string> split(const std::string &str,
                                const std::string &needles = " ");
+// fn(i) for i in [0, n) on up to hardware_concurrency threads; done(i) runs
+// on the calling thread, in order of i, once fn(0..i) have all returned
+void parallelFor(size_t n, const std::function<void(size_t)> &fn,
+                 const std::function<void(size_t)> &done = nullptr);
+std::string jsonQuote(const std::string &str);
+
+// read-only mmap of a whole file
+class MappedFile {
+  const char *data_ = NULL;
+  size_t size_ = 0;
+  bool ok_ = false;
+
+public:
+  explicit MappedFile(const std::string &fname);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  bool ok() const { return ok_; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+// FNV-1a, stable across hosts and builds unlike std::hash
+inline unsigned long long fnv1a(const std::string &str) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (unsigned char c : str) {
+    h = (h ^ c) * 1099511628211ULL;
+  }
+  return h;
+}
 template <typename Forward>
 std::string join(std::string sep, Forward beg, Forward end) {
   std::string res;
@@ -0,0 +1,174 @@
+#include <iostream>
+#include <set>
+#include <stdlib.h>
+#include "delta.hpp"
+#include "variants.hpp"
+
+using namespace std;
+
+namespace icfvar {
+// a merge of the sorted symbols of each key, so linear in both trees
+void Variants::add(const string &name, const Icf &variant) {
+  Variant v;
+  auto &base = base_->store(), &var = variant.store();
+  for (auto &ks : var) {
+    auto b = base.find(ks.first);
+    auto bi = b == base.end() ? ks.second.end() : b->second.begin();
+    auto be = b == base.end() ? ks.second.end() : b->second.end();
+    for (auto &sv : ks.second) {
+      for (; bi != be and bi->first < sv.first; ++bi) {
+        v.overlay[ks.first][bi->first] = Entry{bi->second, true};
+      }
+      if (bi != be and bi->first == sv.first) {
+        bool same = bi->second.first == sv.second.first;
+        ++bi;
+        if (same) {
+          continue;
+        }
+      }
+      v.overlay[ks.first][sv.first] = Entry{sv.second, false};
+    }
+    for (; bi != be; ++bi) {
+      v.overlay[ks.first][bi->first] = Entry{bi->second, true};
+    }
+  }
+  for (auto &ks : base) {
+    if (var.find(ks.first) == var.end()) {
+      auto &removed = v.overlay[ks.first];
+      for (auto &sv : ks.second) {
+        removed[sv.first] = Entry{sv.second, true};
+      }
+    }
+  }
+  for (auto &ks : v.overlay) {
+    v.entries += ks.second.size();
+  }
+  v.sources = variant.sources();
+  variants_[name] = std::move(v);
+}
+
+const Variants::Variant &Variants::variant(const string &name) const {
+  auto itr = variants_.find(name);
+  if (itr == variants_.end()) {
+    cerr << "-- no such variant: " << name << endl;
+    exit(-1);
+  }
+  return itr->second;
+}
+
+const Icf::Sources &Variants::sources(const string &name) const {
+  return variant(name).sources;
+}
+
+size_t Variants::entries(const string &name) const {
+  return variant(name).entries;
+}
+
+// of base if v is NULL, NULL if there is none
+const string *Variants::value(const Variant *v, const Icf::IcfKey &k,
+                              const string &sym) const {
+  if (v) {
+    auto o = v->overlay.find(k);
+    if (o != v->overlay.end()) {
+      auto e = o->second.find(sym);
+      if (e != o->second.end()) {
+        return e->second.removed ? NULL : &e->second.value.first;
+      }
+    }
+  }
+  auto &base = base_->store();
+  auto b = base.find(k);
+  if (b == base.end()) {
+    return NULL;
+  }
+  auto bs = b->second.find(sym);
+  return bs == b->second.end() ? NULL : &bs->second.first;
+}
+
+map<string, string> Variants::query(const string &name, const Icf::IcfKey &k,
+                                    const string &sym) const {
+  auto &v = variant(name);
+  auto ret = base_->query(k, sym);
+  auto o = v.overlay.find(k);
+  if (o == v.overlay.end()) {
+    return ret;
+  }
+  for (auto &se : o->second) {
+    if (not sym.empty() and sym != se.first) {
+      continue;
+    }
+    if (se.second.removed) {
+      ret.erase(se.first);
+    } else {
+      ret[se.first] = se.second.value.first;
+    }
+  }
+  return ret;
+}
+
+void Variants::query_to(ostream &output, const string &name,
+                        const Icf::IcfKey &k, const string &sym) const {
+  const char *h = getenv("VALUE_HISTORY");
+  if (h and *h and string(h) != "0") {
+    cerr << "-- no VALUE_HISTORY of variant " << name
+         << ", its overlay keeps only the last values" << endl;
+    exit(-1);
+  }
+  const char *prefix = getenv("DISPLAY_PREFIX");
+  if (!prefix) {
+    prefix = "";
+  }
+  for (auto &sv : query(name, k, sym)) {
+    output << prefix << k.first << "  " << sv.first << "  " << k.second << '='
+           << sv.second << '\n';
+  }
+}
+
+void Variants::scan(
+    const vector<string> &names,
+    const function<void(const Icf::IcfKey &, const string &,
+                        const vector<const string *> &)> &each) const {
+  vector<const Variant *> vs;
+  set<pair<Icf::IcfKey, string>> differ; // sorted, to print
+  for (auto &n : names) {
+    vs.push_back(&variant(n));
+    for (auto &ks : vs.back()->overlay) {
+      for (auto &se : ks.second) {
+        differ.insert(make_pair(ks.first, se.first));
+      }
+    }
+  }
+  vector<const string *> values(vs.size() + 1);
+  for (auto &ks : differ) {
+    values[0] = value(NULL, ks.first, ks.second);
+    for (size_t i = 0; i < vs.size(); ++i) {
+      values[i + 1] = value(vs[i], ks.first, ks.second);
+    }
+    each(ks.first, ks.second, values);
+  }
+}
+
+int run(const vector<string> &files) {
+  shared_ptr<const Icf> base(new Icf(icfdelta::load(files[0])));
+  Variants vars(base);
+  vector<string> names(begin(files) + 1, end(files));
+  for (auto &n : names) {
+    vars.add(n, icfdelta::load(n)); // one variant tree at a time
+    cout << "# " << n << ": " << vars.entries(n) << " entries differ from "
+         << files[0] << '\n';
+  }
+  const char *prefix = getenv("DISPLAY_PREFIX");
+  if (!prefix) {
+    prefix = "";
+  }
+  vars.scan(names, [&](const Icf::IcfKey &k, const string &sym,
+                       const vector<const string *> &values) {
+    cout << prefix << k.first << "  " << sym << "  " << k.second;
+    for (size_t i = 0; i < values.size(); ++i) {
+      cout << "  " << files[i] << (values[i] ? '=' + *values[i] : " (none)");
+    }
+    cout << '\n';
+  });
+  return cout ? 0 : -1;
+}
+}
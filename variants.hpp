@@ -0,0 +1,69 @@
+#ifndef __ICF_VARIANTS_HPP__
+#define __ICF_VARIANTS_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <iosfwd>
+#include "icf.hpp"
+
+// variants of one tree (x.icf.new, x.icf.nyc.. whose includes CFGPATH picks
+// by extension) held as the base tree and, per variant, only the (key,
+// symbol) entries that differ from it: memory grows with the differences,
+// not the number of variants, and comparing variants scans their overlays
+namespace icfvar {
+class Variants {
+public:
+  explicit Variants(std::shared_ptr<const Icf> base) : base_(base) {}
+
+  const std::shared_ptr<const Icf> &base() const { return base_; }
+  // keeps how variant differs from base; the tree itself may go after
+  void add(const std::string &name, const Icf &variant);
+  bool has(const std::string &name) const {
+    return variants_.find(name) != variants_.end();
+  }
+  const Icf::Sources &sources(const std::string &name) const;
+  size_t entries(const std::string &name) const; // in its overlay
+
+  // as Icf::query and query_to, of a variant added before
+  std::map<std::string, std::string> query(const std::string &name,
+                                           const Icf::IcfKey &k,
+                                           const std::string &sym = "") const;
+  void query_to(std::ostream &output, const std::string &name,
+                const Icf::IcfKey &k, const std::string &sym = "") const;
+  // every (key, symbol) in some overlay with its value in base then in each
+  // variant in names order, NULL where it has none
+  void scan(const std::vector<std::string> &names,
+            const std::function<void(const Icf::IcfKey &, const std::string &,
+                                     const std::vector<const std::string *> &)>
+                &each) const;
+
+private:
+  struct Entry {
+    Icf::WithEnv value;
+    bool removed; // in base, not in the variant
+  };
+  typedef std::unordered_map<Icf::IcfKey, std::map<std::string, Entry>,
+                             Icf::Hasher, Icf::Equaler>
+      Overlay;
+  struct Variant {
+    Overlay overlay;
+    size_t entries = 0;
+    Icf::Sources sources;
+  };
+  const Variant &variant(const std::string &name) const;
+  const std::string *value(const Variant *v, const Icf::IcfKey &k,
+                           const std::string &sym) const;
+
+  std::shared_ptr<const Icf> base_;
+  std::map<std::string, Variant> variants_;
+};
+
+// icfdiff --variants: base and variants loaded as overlays, then entries
+// that differ between any of them, to stdout
+int run(const std::vector<std::string> &files);
+}
+
+#endif